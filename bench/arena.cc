@@ -0,0 +1,85 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <chrono>
+#include <cstdio>
+
+#include "ltm.h"
+
+using ltm::own;
+
+// Time to build, copy and drop short-lived trees, on the heap and inside of
+// arena scopes.
+
+namespace {
+
+struct Node : ltm::Object {
+  int value;
+  own<Node> left, right;
+
+  explicit Node(int value) : value(value) {}
+  LTM_COPYABLE(Node);
+};
+
+own<Node> make_tree(int depth, int value) {
+  own<Node> r = own<Node>::make(value);
+  if (depth > 0) {
+    r->left = make_tree(depth - 1, value * 2);
+    r->right = make_tree(depth - 1, value * 2 + 1);
+  }
+  return r;
+}
+
+long long sum(const own<Node>& n) {
+  return n ? n->value + sum(n->left) + sum(n->right) : 0;
+}
+
+long long request(int depth) {
+  own<Node> tree = make_tree(depth, 1);
+  own<Node> copy = tree;
+  return sum(copy);
+}
+
+template <typename F>
+void run(const char* name, int depth, int requests, F f) {
+  double best = 1e9;
+  long long s = 0;
+  for (int i = 0; i < 5; i++) {
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < requests; r++)
+      s += f(depth);
+    auto end = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(end - start).count();
+    if (sec < best)
+      best = sec;
+  }
+  double objects = 2.0 * ((1 << (depth + 1)) - 1) * requests;
+  std::printf("%-6s depth %2d %8.3f ms %8.2f Mobj/s (sum %lld)\n", name, depth,
+              best * 1e3, objects / best / 1e6, s);
+}
+
+}  // namespace
+
+int main() {
+  for (int depth = 4; depth <= 16; depth += 6) {
+    int requests = (1 << 20) >> depth;
+    run("heap", depth, requests, request);
+    run("arena", depth, requests, [](int d) {
+      ltm::arena scope;
+      return request(d);
+    });
+  }
+  return 0;
+}
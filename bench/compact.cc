@@ -0,0 +1,85 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "ltm.h"
+
+using ltm::own;
+
+// Traversal time of a tree built incrementally, before and after compaction.
+
+namespace {
+
+struct Node : ltm::Object {
+  int value;
+  own<Node> left, right;
+
+  explicit Node(int value) : value(value) {}
+  LTM_COPYABLE(Node);
+};
+
+// Inserts random keys into a binary search tree, so parents and children
+// are allocated at different times, interleaved with short-lived blocks.
+own<Node> make_tree(int n) {
+  std::mt19937 random(1);
+  std::vector<own<Node>> garbage;
+  own<Node> root;
+  for (int i = 0; i < n; i++) {
+    int key = static_cast<int>(random() % (n * 4));
+    own<Node>* slot = &root;
+    while (*slot)
+      slot = key < (*slot)->value ? &(*slot)->left : &(*slot)->right;
+    *slot = new Node(key);
+    garbage.push_back(new Node(i));
+    if (garbage.size() > 64)
+      garbage.erase(garbage.begin() + random() % garbage.size());
+  }
+  return root;
+}
+
+long long sum(const own<Node>& n) {
+  return n ? n->value + sum(n->left) + sum(n->right) : 0;
+}
+
+void run(const char* name, const own<Node>& root, int objects) {
+  double best = 1e9;
+  long long s = 0;
+  for (int i = 0; i < 5; i++) {
+    auto start = std::chrono::steady_clock::now();
+    s = sum(root);
+    auto end = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(end - start).count();
+    if (sec < best)
+      best = sec;
+  }
+  std::printf("%-9s %9d objects %8.3f ms %8.2f Mobj/s (sum %lld)\n", name,
+              objects, best * 1e3, objects / best / 1e6, s);
+}
+
+}  // namespace
+
+int main() {
+  for (int n = 10000; n <= 1000000; n *= 10) {
+    own<Node> root = make_tree(n);
+    run("scattered", root, n);
+    ltm::compact(root);
+    run("compact", root, n);
+  }
+  return 0;
+}
@@ -0,0 +1,114 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <chrono>
+#include <cstdio>
+#include <utility>
+
+#include "ltm.h"
+
+using ltm::own;
+using ltm::weak;
+
+// Copy throughput for composition hierarchies that are too deep to be
+// copied recursively.
+
+namespace {
+
+struct Node : ltm::Object {
+  int value;
+  own<Node> next;
+  weak<Node> prev;
+
+  explicit Node(int value) : value(value) {}
+
+  LTM_ITERATIVE_COPYABLE(Node);
+};
+
+// Each level has a short leaf and a long subtree, so the depth is n.
+struct TreeNode : ltm::Object {
+  own<TreeNode> leaf, subtree;
+  weak<TreeNode> parent;
+
+  LTM_ITERATIVE_COPYABLE(TreeNode);
+};
+
+template <typename T, typename NEXT>
+void destroy_chain(own<T>& head, NEXT next) {
+  while (head) {
+    own<T> rest = std::move(next(*head));
+    head = std::move(rest);
+  }
+}
+
+own<Node> make_list(int n) {
+  own<Node> head = new Node(0);
+  Node* tail = &*head;
+  for (int i = 1; i < n; i++) {
+    tail->next = new Node(i);
+    tail->next->prev = tail;
+    tail = &*tail->next;
+  }
+  return head;
+}
+
+own<TreeNode> make_tree(int depth) {
+  own<TreeNode> root = new TreeNode();
+  TreeNode* n = &*root;
+  for (int i = 1; i < depth; i++) {
+    n->leaf = new TreeNode();
+    n->leaf->parent = n;
+    n->subtree = new TreeNode();
+    n->subtree->parent = n;
+    n = &*n->subtree;
+  }
+  return root;
+}
+
+// Reports the best of a few runs, so first touches of freshly mapped heap
+// pages don't count.
+template <typename T, typename NEXT>
+void run(const char* name, own<T>& src, int objects, NEXT next) {
+  double best = 1e9;
+  for (int i = 0; i < 3; i++) {
+    auto start = std::chrono::steady_clock::now();
+    own<T> copy = src;
+    auto end = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(end - start).count();
+    if (sec < best)
+      best = sec;
+    destroy_chain(copy, next);
+  }
+  std::printf("%-6s %9d objects %8.3f ms %8.2f Mobj/s\n", name, objects,
+              best * 1e3, objects / best / 1e6);
+}
+
+}  // namespace
+
+int main() {
+  for (int n = 1000; n <= 1000000; n *= 10) {
+    own<Node> list = make_list(n);
+    run("list", list, n, [](Node& n) -> own<Node>& { return n.next; });
+    destroy_chain(list, [](Node& n) -> own<Node>& { return n.next; });
+  }
+  for (int n = 1000; n <= 1000000; n *= 10) {
+    own<TreeNode> tree = make_tree(n);
+    run("tree", tree, 2 * n - 1,
+        [](TreeNode& n) -> own<TreeNode>& { return n.subtree; });
+    destroy_chain(tree,
+                  [](TreeNode& n) -> own<TreeNode>& { return n.subtree; });
+  }
+  return 0;
+}
@@ -0,0 +1,105 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+#include "ltm.h"
+
+using ltm::own;
+using ltm::pin;
+using ltm::weak;
+
+// Binding, firing and copying of handlers: std::function capturing a weak
+// pointer vs ltm::delegate.
+
+namespace {
+
+struct Listener : ltm::Object {
+  long long sum = 0;
+  void on_event(int v) { sum += v; }
+  LTM_COPYABLE(Listener);
+};
+
+struct FunctionNode : ltm::Object {
+  own<Listener> listener = own<Listener>::make();
+  std::vector<std::function<void(int)>> handlers;
+  LTM_COPYABLE(FunctionNode);
+};
+
+struct DelegateNode : ltm::Object {
+  own<Listener> listener = own<Listener>::make();
+  std::vector<ltm::delegate<void(int)>> handlers;
+  LTM_COPYABLE(DelegateNode);
+};
+
+const int HANDLERS = 1000;
+const int EVENTS = 10000;
+
+template <typename F>
+double measure(F f) {
+  double best = 1e9;
+  for (int i = 0; i < 5; i++) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(end - start).count();
+    if (sec < best)
+      best = sec;
+  }
+  return best;
+}
+
+template <typename NODE, typename BIND>
+void run(const char* name, BIND bind) {
+  own<NODE> node = own<NODE>::make();
+  double bind_time = measure([&] {
+    node->handlers.clear();
+    for (int i = 0; i < HANDLERS; i++)
+      node->handlers.push_back(bind(node->listener));
+  });
+  double fire_time = measure([&] {
+    for (int e = 0; e < EVENTS / 10; e++) {
+      for (auto& h : node->handlers)
+        h(e);
+    }
+  });
+  double copy_time = measure([&] { own<NODE> copy = node; });
+  std::printf("%-8s bind %7.1f ns  fire %6.2f ns  copy %7.1f ns (sum %lld)\n",
+              name, bind_time / HANDLERS * 1e9,
+              fire_time / (EVENTS / 10) / HANDLERS * 1e9,
+              copy_time / HANDLERS * 1e9, node->listener->sum);
+}
+
+}  // namespace
+
+int main() {
+  run<FunctionNode>("function", [](const own<Listener>& l) {
+    return std::function<void(int)>([w = weak<Listener>(l)](int v) {
+      if (auto me = w.pinned())
+        me->on_event(v);
+    });
+  });
+  run<DelegateNode>("method", [](const own<Listener>& l) {
+    return ltm::delegate<void(int)>(l, &Listener::on_event);
+  });
+  run<DelegateNode>("functor", [](const own<Listener>& l) {
+    return ltm::delegate<void(int)>(
+        l, [](Listener& me, int v) { me.on_event(v); });
+  });
+  return 0;
+}
@@ -0,0 +1,78 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+#include "ltm.h"
+
+using ltm::own;
+using ltm::weak;
+
+// Scaling of parallel_copy for a tree of 2^21 - 1 objects, each having
+// a weak pointer to its parent and some having weaks to other subtrees.
+
+namespace {
+
+struct Node : ltm::Object {
+  int id;
+  own<Node> left, right;
+  weak<Node> parent, cross;
+
+  explicit Node(int id) : id(id) {}
+  LTM_ITERATIVE_COPYABLE(Node);
+};
+
+own<Node> make_tree(int depth, int& id) {
+  own<Node> r = new Node(id++);
+  if (--depth > 0) {
+    r->left = make_tree(depth, id);
+    r->right = make_tree(depth, id);
+    r->left->parent = r;
+    r->right->parent = r;
+    r->left->cross = r->right->left;
+  }
+  return r;
+}
+
+}  // namespace
+
+int main() {
+  const int kDepth = 21;
+  int objects = 0;
+  own<Node> tree = make_tree(kDepth, objects);
+  std::size_t max_threads = std::thread::hardware_concurrency();
+  if (max_threads < 4)
+    max_threads = 4;
+  double base = 0;
+  for (std::size_t threads = 1; threads <= max_threads; threads++) {
+    double best = 1e9;
+    for (int i = 0; i < 3; i++) {
+      auto start = std::chrono::steady_clock::now();
+      own<Node> copy = ltm::parallel_copy(tree, threads);
+      auto end = std::chrono::steady_clock::now();
+      double sec = std::chrono::duration<double>(end - start).count();
+      if (sec < best)
+        best = sec;
+    }
+    if (threads == 1)
+      base = best;
+    std::printf("%2zu threads %9d objects %8.3f ms %8.2f Mobj/s x%.2f\n",
+                threads, objects, best * 1e3, objects / best / 1e6,
+                base / best);
+  }
+  return 0;
+}
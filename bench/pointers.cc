@@ -0,0 +1,351 @@
+/*
+Copyright 2018 Google LLC
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    https://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "ltm.h"
+
+using ltm::own;
+using ltm::pin;
+using ltm::weak;
+
+// Compares ltm pointers with std::shared_ptr/weak_ptr and
+// std::unique_ptr + hand-written clone on trees of 10..10^7 objects.
+// Prints nanoseconds per object for each operation.
+// Usage: pointers [max_size]
+
+namespace {
+
+volatile int sink;
+
+// Runs `body(state, i)` for i in [0, reps) enough times to process at least
+// 10^6 objects, where state is made by untimed `setup(reps)`.
+// Returns the best time per object.
+template <typename SETUP, typename BODY>
+double measure(std::size_t n, SETUP setup, BODY body) {
+  std::size_t reps = n >= 1000000 ? 1 : 1000000 / n;
+  double best = 1e30;
+  for (int attempt = 0; attempt < 3; attempt++) {
+    auto state = setup(reps);
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < reps; i++)
+      body(state, i);
+    double ns = std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    if (ns < best)
+      best = ns;
+  }
+  return best / double(reps * n);
+}
+
+// Zero time means that there is no equivalent.
+void report(const char* test, std::size_t n, double ltm_ns, double shared_ns,
+            double unique_ns) {
+  std::printf("%-22s %9zu %9.2f %9.2f", test, n, ltm_ns, shared_ns);
+  if (unique_ns)
+    std::printf(" %9.2f\n", unique_ns);
+  else
+    std::printf(" %9s\n", "-");
+}
+
+// Every `ref_step`-th node has a weak/raw reference to some other node.
+std::size_t ref_target(std::size_t i, std::size_t n) {
+  return (i * 7919 + 13) % n;
+}
+
+struct LtmNode : ltm::Object {
+  int value = 0;
+  own<LtmNode> left, right;
+  weak<LtmNode> ref;
+  LTM_COPYABLE(LtmNode);
+};
+
+struct SharedNode {
+  int value = 0;
+  std::shared_ptr<SharedNode> left, right;
+  std::weak_ptr<SharedNode> ref;
+};
+
+struct UniqueNode {
+  int value = 0;
+  std::unique_ptr<UniqueNode> left, right;
+  UniqueNode* ref = nullptr;
+};
+
+// Balanced binary trees of n nodes, `nodes` receives them in preorder.
+template <typename NODE, typename PTR, typename MAKE>
+PTR build(std::size_t n, std::vector<NODE*>& nodes, MAKE make) {
+  if (!n)
+    return nullptr;
+  PTR r = make();
+  nodes.push_back(&*r);
+  r->value = int(nodes.size());
+  --n;
+  r->left = build<NODE, PTR>(n / 2, nodes, make);
+  r->right = build<NODE, PTR>(n - n / 2, nodes, make);
+  return r;
+}
+
+own<LtmNode> ltm_tree(std::size_t n, std::size_t ref_step) {
+  std::vector<LtmNode*> nodes;
+  auto r = build<LtmNode, own<LtmNode>>(n, nodes, [] {
+    return own<LtmNode>(new LtmNode);
+  });
+  for (std::size_t i = 0; ref_step && i < n; i += ref_step)
+    nodes[i]->ref = nodes[ref_target(i, n)];
+  return r;
+}
+
+std::shared_ptr<SharedNode> shared_tree(std::size_t n, std::size_t ref_step) {
+  std::vector<SharedNode*> nodes;
+  std::vector<std::shared_ptr<SharedNode>> ptrs;
+  auto r = build<SharedNode, std::shared_ptr<SharedNode>>(n, nodes, [&] {
+    ptrs.push_back(std::make_shared<SharedNode>());
+    return ptrs.back();
+  });
+  for (std::size_t i = 0; ref_step && i < n; i += ref_step)
+    nodes[i]->ref = ptrs[ref_target(i, n)];
+  return r;
+}
+
+std::unique_ptr<UniqueNode> unique_tree(std::size_t n, std::size_t ref_step) {
+  std::vector<UniqueNode*> nodes;
+  auto r = build<UniqueNode, std::unique_ptr<UniqueNode>>(n, nodes, [] {
+    return std::unique_ptr<UniqueNode>(new UniqueNode);
+  });
+  for (std::size_t i = 0; ref_step && i < n; i += ref_step)
+    nodes[i]->ref = nodes[ref_target(i, n)];
+  return r;
+}
+
+// Deep copies of std trees: a map from originals to copies remaps references
+// inside of the copied tree in a second pass.
+std::shared_ptr<SharedNode> clone_shared(
+    const SharedNode* src,
+    std::unordered_map<const SharedNode*, std::shared_ptr<SharedNode>>& map) {
+  if (!src)
+    return nullptr;
+  auto r = std::make_shared<SharedNode>();
+  r->value = src->value;
+  map[src] = r;
+  r->left = clone_shared(&*src->left, map);
+  r->right = clone_shared(&*src->right, map);
+  return r;
+}
+
+std::shared_ptr<SharedNode> clone_shared(const SharedNode* src) {
+  std::unordered_map<const SharedNode*, std::shared_ptr<SharedNode>> map;
+  auto r = clone_shared(src, map);
+  for (auto& i : map) {
+    if (auto target = i.first->ref.lock()) {
+      auto it = map.find(&*target);
+      i.second->ref = it == map.end() ? target : it->second;
+    }
+  }
+  return r;
+}
+
+UniqueNode* clone_unique(const UniqueNode* src,
+                         std::unique_ptr<UniqueNode>& dst,
+                         std::unordered_map<const UniqueNode*, UniqueNode*>& map) {
+  if (!src)
+    return nullptr;
+  dst.reset(new UniqueNode);
+  dst->value = src->value;
+  map[src] = &*dst;
+  clone_unique(&*src->left, dst->left, map);
+  clone_unique(&*src->right, dst->right, map);
+  return &*dst;
+}
+
+std::unique_ptr<UniqueNode> clone_unique(const UniqueNode* src) {
+  std::unordered_map<const UniqueNode*, UniqueNode*> map;
+  std::unique_ptr<UniqueNode> r;
+  clone_unique(src, r, map);
+  for (auto& i : map) {
+    if (i.first->ref) {
+      auto it = map.find(i.first->ref);
+      i.second->ref = it == map.end() ? i.first->ref : it->second;
+    }
+  }
+  return r;
+}
+
+struct LtmLeaf : ltm::Object {
+  int value = 1;
+  LTM_COPYABLE(LtmLeaf);
+};
+
+struct Leaf {
+  int value = 1;
+};
+
+void run(std::size_t n) {
+  report("construction", n,
+         measure(n, [](std::size_t) { return 0; },
+                 [n](int, std::size_t) { sink = ltm_tree(n, 0)->value; }),
+         measure(n, [](std::size_t) { return 0; },
+                 [n](int, std::size_t) { sink = shared_tree(n, 0)->value; }),
+         measure(n, [](std::size_t) { return 0; },
+                 [n](int, std::size_t) { sink = unique_tree(n, 0)->value; }));
+
+  // Destruction: trees are built in setup and destroyed in the body.
+  report("destruction", n,
+         measure(n,
+                 [n](std::size_t reps) {
+                   std::vector<own<LtmNode>> trees;
+                   for (std::size_t i = 0; i < reps; i++)
+                     trees.push_back(ltm_tree(n, 0));
+                   return trees;
+                 },
+                 [](std::vector<own<LtmNode>>& trees, std::size_t i) {
+                   trees[i] = nullptr;
+                 }),
+         measure(n,
+                 [n](std::size_t reps) {
+                   std::vector<std::shared_ptr<SharedNode>> trees;
+                   for (std::size_t i = 0; i < reps; i++)
+                     trees.push_back(shared_tree(n, 0));
+                   return trees;
+                 },
+                 [](std::vector<std::shared_ptr<SharedNode>>& trees,
+                    std::size_t i) { trees[i].reset(); }),
+         measure(n,
+                 [n](std::size_t reps) {
+                   std::vector<std::unique_ptr<UniqueNode>> trees;
+                   for (std::size_t i = 0; i < reps; i++)
+                     trees.push_back(unique_tree(n, 0));
+                   return trees;
+                 },
+                 [](std::vector<std::unique_ptr<UniqueNode>>& trees,
+                    std::size_t i) { trees[i].reset(); }));
+
+  // Retain/release of temporary references to every leaf.
+  {
+    std::vector<own<LtmLeaf>> ltm_leaves(n);
+    std::vector<std::shared_ptr<Leaf>> shared_leaves(n);
+    for (std::size_t i = 0; i < n; i++) {
+      ltm_leaves[i] = new LtmLeaf;
+      shared_leaves[i] = std::make_shared<Leaf>();
+    }
+    report("pin retain/release", n,
+           measure(n, [](std::size_t) { return 0; },
+                   [&](int, std::size_t) {
+                     int s = 0;
+                     for (auto& i : ltm_leaves) {
+                       pin<LtmLeaf> p = i;
+                       s += p->value;
+                     }
+                     sink = s;
+                   }),
+           measure(n, [](std::size_t) { return 0; },
+                   [&](int, std::size_t) {
+                     int s = 0;
+                     for (auto& i : shared_leaves) {
+                       std::shared_ptr<Leaf> p = i;
+                       s += p->value;
+                     }
+                     sink = s;
+                   }),
+           0);
+
+    std::vector<weak<LtmLeaf>> ltm_weaks(ltm_leaves.begin(), ltm_leaves.end());
+    std::vector<std::weak_ptr<Leaf>> std_weaks(shared_leaves.begin(),
+                                               shared_leaves.end());
+    report("weak->pin", n,
+           measure(n, [](std::size_t) { return 0; },
+                   [&](int, std::size_t) {
+                     int s = 0;
+                     for (auto& i : ltm_weaks) {
+                       if (pin<LtmLeaf> p = i)
+                         s += p->value;
+                     }
+                     sink = s;
+                   }),
+           measure(n, [](std::size_t) { return 0; },
+                   [&](int, std::size_t) {
+                     int s = 0;
+                     for (auto& i : std_weaks) {
+                       if (auto p = i.lock())
+                         s += p->value;
+                     }
+                     sink = s;
+                   }),
+           0);
+
+    report("bundle copy", n,
+           measure(n, [](std::size_t) { return 0; },
+                   [&](int, std::size_t) {
+                     std::vector<own<LtmLeaf>> copy;
+                     copy.reserve(n);
+                     ltm::Object::copy(ltm_leaves.begin(), ltm_leaves.end(),
+                                       std::back_inserter(copy));
+                     sink = copy.back()->value;
+                   }),
+           measure(n, [](std::size_t) { return 0; },
+                   [&](int, std::size_t) {
+                     std::vector<std::shared_ptr<Leaf>> copy;
+                     copy.reserve(n);
+                     for (auto& i : shared_leaves)
+                       copy.push_back(std::make_shared<Leaf>(*i));
+                     sink = copy.back()->value;
+                   }),
+           measure(n, [](std::size_t) { return 0; }, [&](int, std::size_t) {
+             std::vector<std::unique_ptr<Leaf>> copy;
+             copy.reserve(n);
+             for (auto& i : shared_leaves)
+               copy.emplace_back(new Leaf(*i));
+             sink = copy.back()->value;
+           }));
+  }
+
+  // Deep copy with one cross reference per `step` nodes.
+  static const std::size_t steps[] = {0, 10, 1};
+  static const char* names[] = {"deep copy, no refs", "deep copy, 10% refs",
+                                "deep copy, 100% refs"};
+  for (int i = 0; i < 3; i++) {
+    std::size_t step = steps[i];
+    own<LtmNode> lt = ltm_tree(n, step);
+    double l = measure(n, [](std::size_t) { return 0; },
+                       [&](int, std::size_t) { own<LtmNode> c = lt; sink = c->value; });
+    lt = nullptr;
+    auto st = shared_tree(n, step);
+    double s = measure(n, [](std::size_t) { return 0; },
+                       [&](int, std::size_t) { sink = clone_shared(&*st)->value; });
+    st = nullptr;
+    auto ut = unique_tree(n, step);
+    double u = measure(n, [](std::size_t) { return 0; },
+                       [&](int, std::size_t) { sink = clone_unique(&*ut)->value; });
+    report(names[i], n, l, s, u);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::size_t max_size = argc > 1 ? std::strtoull(argv[1], nullptr, 10)
+                                  : 10000000;
+  std::printf("%-22s %9s %9s %9s %9s\n", "ns per object", "size", "ltm",
+              "shared", "unique");
+  for (std::size_t n = 10; n <= max_size; n *= 10)
+    run(n);
+  return 0;
+}
@@ -134,6 +134,9 @@ private:
     case TypeInfo::OWN:
       write_ptr(type->get_ptr(data), Dom::get_type(type->get_ptr(data)), true);
       break;
+    case TypeInfo::SOA_ARRAY:
+      error("unsupported kind");
+      break;
     }
   }
 
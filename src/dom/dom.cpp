@@ -1,5 +1,7 @@
 #include "dom.h"
 
+#include <cstring>
+
 namespace dom {
 
 pin<FieldInfo> TypeInfo::get_field(pin<Name>) {
@@ -24,8 +26,12 @@ public:
   void init(char* data) override { new(data) T(); }
   void dispose(char* data) { reinterpret_cast<T*>(data)->T::~T(); }
   size_t get_size() override { return sizeof(T); }
+  size_t get_alignment() override { return alignof(T); }
   void move(char* src, char* dst) override { new(dst) T(std::move(*reinterpret_cast<T*>(src))); };
   void copy(char* src, char* dst) override { new(dst) T(*reinterpret_cast<T*>(src)); };
+  bool is_trivially_copyable() override { return std::is_trivially_copyable<T>::value; }
+  bool is_trivially_destructible() override { return std::is_trivially_destructible<T>::value; }
+  bool is_zero_initializable() override { return std::is_arithmetic<T>::value; }
 };
 
 class StringType : public PrimitiveType<string, TypeInfo::STRING>
@@ -78,6 +84,7 @@ class PtrType : public PrimitiveType<PTR, ID>
 public:
   pin<DomItem> get_ptr(char* data) override { return *reinterpret_cast<PTR*>(data); }
   void set_ptr(const pin<DomItem>& v, char* data) override { *reinterpret_cast<PTR*>(data) = v; }
+  bool is_zero_initializable() override { return true; }  // null
   LTM_COPYABLE(PtrType)
 };
 
@@ -86,98 +93,194 @@ class AtomType : public PrimitiveType<own<Name>, TypeInfo::ATOM>
 public:
   pin<Name> get_atom(char* data) override { return *reinterpret_cast<own<Name>*>(data); }
   void set_atom(pin<Name> v, char* data) override { *reinterpret_cast<own<Name>*>(data) = v; }
+  bool is_zero_initializable() override { return true; }  // null
   LTM_COPYABLE(AtomType)
 };
 
+// Bulk operations on ranges of values of one type.
+struct Items {
+  explicit Items(pin<TypeInfo> type)
+    : type(type)
+    , size(type->get_size())
+    , trivial_copy(type->is_trivially_copyable())
+    , trivial_dispose(type->is_trivially_destructible())
+    , zero_init(type->is_zero_initializable()) {}
+
+  void init(char* items, size_t count) {
+    if (zero_init) {
+      memset(items, 0, count * size);
+      return;
+    }
+    for (size_t i = count + 1; --i; items += size)
+      type->init(items);
+  }
+
+  void dispose(char* items, size_t count) {
+    if (trivial_dispose)
+      return;
+    for (size_t i = count + 1; --i; items += size)
+      type->dispose(items);
+  }
+
+  void copy(char* src, char* dst, size_t count) {
+    if (trivial_copy) {
+      if (count)
+        memcpy(dst, src, count * size);
+      return;
+    }
+    for (size_t i = count + 1; --i; src += size, dst += size)
+      type->copy(src, dst);
+  }
+
+  // Leaves sources disposed, ranges can overlap.
+  void move(char* src, char* dst, size_t count) {
+    if (trivial_copy && trivial_dispose) {
+      if (count)
+        memmove(dst, src, count * size);
+      return;
+    }
+    if (dst > src) {
+      src += count * size;
+      dst += count * size;
+      for (size_t i = count + 1; --i;) {
+        src -= size;
+        dst -= size;
+        type->move(src, dst);
+        type->dispose(src);
+      }
+      return;
+    }
+    for (size_t i = count + 1; --i; src += size, dst += size) {
+      type->move(src, dst);
+      type->dispose(src);
+    }
+  }
+
+  own<TypeInfo> type;
+  size_t size;
+  bool trivial_copy;
+  bool trivial_dispose;
+  bool zero_init;
+};
+
 class VarArrayType : public TypeInfo
 {
   struct Data{
     size_t count;
+    size_t capacity;
     char* items;
   };
 public:
-  VarArrayType(pin<TypeInfo> element_type)
-    : element_type(element_type)
-    , element_size(element_type->get_size()) {}
+  VarArrayType(pin<TypeInfo> element_type) : items(element_type) {}
 
   size_t get_size() override { return sizeof(Data); }
+  bool is_zero_initializable() override { return true; }  // empty
+  size_t get_alignment() override { return alignof(Data); }
 
   Type get_type() override { return TypeInfo::VAR_ARRAY; }
 
-  pin<TypeInfo> get_element_type() override { return element_type; }
+  pin<TypeInfo> get_element_type() override { return items.type; }
   size_t get_elements_count(char* data) override { return reinterpret_cast<Data*>(data)->count; }
+  size_t get_capacity(char* data) override { return reinterpret_cast<Data*>(data)->capacity; }
 
   void init(char* data) override {
     Data* d = reinterpret_cast<Data*>(data);
     d->count = 0;
+    d->capacity = 0;
     d->items = nullptr;
   }
 
   void dispose(char* data) override {
     Data* d = reinterpret_cast<Data*>(data);
-    char* item = d->items;
-    for (size_t i = d->count + 1; --i; item += element_size) {
-      element_type->dispose(item);
-    }
+    items.dispose(d->items, d->count);
     delete[] d->items;
   };
 
+  // Like other types, move and copy construct dst.
   void move(char* src, char* dst) override {
-    Data* d = reinterpret_cast<Data*>(dst);
     Data* s = reinterpret_cast<Data*>(src);
-    Data t = *s;
+    *reinterpret_cast<Data*>(dst) = *s;
     init(src);
-    dispose(dst);
-    *d = t;
   };
 
   void copy(char* src, char* dst) override {
-    Data* d = reinterpret_cast<Data*>(dst);
     Data* s = reinterpret_cast<Data*>(src);
-    Data t{s->count, new char[element_size * s->count]};
-    char* si = s->items;
-    char* di = t.items;
-    for (size_t i = s->count + 1; --i; si += element_size, di += element_size) {
-      element_type->copy(si, di);
-    }
-    dispose(dst);
-    *d = t;    
+    Data t{s->count, s->count, new char[items.size * s->count]};
+    items.copy(s->items, t.items, s->count);
+    *reinterpret_cast<Data*>(dst) = t;
   };
 
   char* get_element_ptr(size_t index, char* data) override {
     return index < reinterpret_cast<Data*>(data)->count
-      ? reinterpret_cast<Data*>(data)->items + index * element_size
+      ? reinterpret_cast<Data*>(data)->items + index * items.size
       : nullptr;
   }
 
   void set_elements_count(size_t count, char* data) override {
     Data* v = reinterpret_cast<Data*>(data);
-    if (v->count == count)
-      return;
-    char* dst = new char[count * element_size];
-    char* si = v->items;
-    char* di = dst;
-    for (size_t i = min(v->count, count) + 1; --i; si += element_size, di += element_size) {
-      element_type->move(si, di);
-      element_type->dispose(si);
-    }
-    if (v->count < count) {
-      for (size_t i = count - v->count + 1; --i; di += element_size) {
-        element_type->init(di);
-      }
+    if (count > v->count) {
+      grow(v, count);
+      items.init(v->items + v->count * items.size, count - v->count);
     } else {
-      for (size_t i = v->count - count + 1; --i; si += element_size) {
-        element_type->dispose(si);
-      }
+      items.dispose(v->items + count * items.size, v->count - count);
     }
-    delete[] v->items;
-    v->items = dst;
     v->count = count;
   }
 
+  void reserve(size_t capacity, char* data) override {
+    Data* v = reinterpret_cast<Data*>(data);
+    if (capacity > v->capacity)
+      reallocate(v, capacity);
+  }
+
+  void shrink_to_fit(char* data) override {
+    Data* v = reinterpret_cast<Data*>(data);
+    if (v->capacity > v->count)
+      reallocate(v, v->count);
+  }
+
+  char* insert_elements(size_t index, size_t count, char* data) override {
+    Data* v = reinterpret_cast<Data*>(data);
+    if (index > v->count) {
+      report_error("insert_elements index out of range");
+      return nullptr;
+    }
+    grow(v, v->count + count);
+    char* at = v->items + index * items.size;
+    items.move(at, at + count * items.size, v->count - index);
+    items.init(at, count);
+    v->count += count;
+    return at;
+  }
+
+  void erase_elements(size_t index, size_t count, char* data) override {
+    Data* v = reinterpret_cast<Data*>(data);
+    if (index > v->count || count > v->count - index) {
+      report_error("erase_elements range out of bounds");
+      return;
+    }
+    char* at = v->items + index * items.size;
+    items.dispose(at, count);
+    items.move(at + count * items.size, at, v->count - index - count);
+    v->count -= count;
+  }
+
 protected:
-  own<TypeInfo> element_type;
-  size_t element_size;
+  // Makes room for count items, at least doubling the capacity.
+  void grow(Data* v, size_t count) {
+    if (count > v->capacity)
+      reallocate(v, std::max(count, v->capacity * 2));
+  }
+
+  void reallocate(Data* v, size_t capacity) {
+    char* dst = capacity ? new char[capacity * items.size] : nullptr;
+    items.move(v->items, dst, v->count);
+    delete[] v->items;
+    v->items = dst;
+    v->capacity = capacity;
+  }
+
+  Items items;
   LTM_COPYABLE(VarArrayType)
 };
 
@@ -187,9 +290,13 @@ public:
   FixArrayType(pin<TypeInfo> element_type, size_t elements_count)
     : element_type(element_type)
     , elements_count(elements_count)
-    , element_size(element_type->get_size()) {}
+    , element_size(element_type->get_size())
+    , trivial_copy(element_type->is_trivially_copyable())
+    , trivial_dispose(element_type->is_trivially_destructible())
+    , zero_init(element_type->is_zero_initializable()) {}
 
   size_t get_size() override { return element_size * elements_count; }
+  size_t get_alignment() override { return element_type->get_alignment(); }
 
   Type get_type() override { return TypeInfo::FIX_ARRAY; }
 
@@ -201,25 +308,43 @@ public:
 
   size_t get_elements_count(char*) override { return elements_count; }
 
+  bool is_trivially_copyable() override { return trivial_copy; }
+  bool is_trivially_destructible() override { return trivial_dispose; }
+  bool is_zero_initializable() override { return zero_init; }
+
   void init(char* data) override {
+    if (zero_init) {
+      memset(data, 0, get_size());
+      return;
+    }
     for (size_t i = elements_count + 1; --i; data += element_size) {
       element_type->init(data);
     }
   }
 
   void dispose(char* data) override {
+    if (trivial_dispose)
+      return;
     for (size_t i = elements_count + 1; --i; data += element_size) {
       element_type->dispose(data);
     }    
   };
 
   void move(char* src, char* dst) override {
+    if (trivial_copy) {
+      memcpy(dst, src, get_size());
+      return;
+    }
     for (size_t i = elements_count + 1; --i; src += element_size, dst += element_size) {
       element_type->move(src, dst);
     }
   };
 
   void copy(char* src, char* dst) override {
+    if (trivial_copy) {
+      memcpy(dst, src, get_size());
+      return;
+    }
     for (size_t i = elements_count + 1; --i; src += element_size, dst += element_size) {
       element_type->copy(src, dst);
     }
@@ -229,6 +354,9 @@ protected:
   own<TypeInfo> element_type;
   size_t elements_count;
   size_t element_size;
+  bool trivial_copy;
+  bool trivial_dispose;
+  bool zero_init;
   LTM_COPYABLE(FixArrayType)
 };
 
@@ -243,7 +371,10 @@ public:
 protected:
   DomItemImpl(pin<TypeInfo> type) :type(move(type)) {}
   void copy_to(Object*& d) override {
-    d = alloc(type);
+    // Fields don't access their targets when copied.
+    deferred_copy_scope deferred;
+    // The copy constructor makes the copy owned.
+    d = new (new char[sizeof(DomItemImpl) + type->get_size()]) DomItemImpl(*this);
     type->copy(data, static_cast<DomItemImpl*>(d)->data);
   }
 
@@ -266,54 +397,109 @@ class StructType : public TypeInfo
 public:
   Type get_type() override { return STRUCT; }
   size_t get_size() override { return instance_size; }
+  size_t get_alignment() override { return alignment; }
 
+  // Fields are placed by decreasing alignment, so there is no padding
+  // between them, fields of the same alignment keep declaration order.
   StructType(pin<Name> name, vector<pin<FieldInfo>> init_fields)
     : name(name)
   {
+    for (auto& f : init_fields) {
+      if (index.insert({f->name, declared.size()}).second) {
+        declared.push_back(declared.size());
+      } else {
+        report_error("duplicated field " + f->name->name);
+        f = nullptr;
+      }
+    }
+    for (auto& f : init_fields) {
+      if (f)
+        fields.push_back(f);
+    }
+    vector<size_t> order(declared);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return fields[a]->type->get_alignment() > fields[b]->type->get_alignment();
+    });
+    vector<own<FieldInfo>> layout;
+    layout.reserve(fields.size());
     instance_size = 0;
-    for (auto& f : init_fields){
-      fields.insert({f->name, f});
+    alignment = 1;
+    for (size_t i = 0; i < order.size(); i++) {
+      auto& f = fields[order[i]];
+      size_t align = f->type->get_alignment();
+      alignment = std::max(alignment, align);
+      instance_size = (instance_size + align - 1) / align * align;
       f->offset = instance_size;
       instance_size += f->type->get_size();
+      declared[order[i]] = i;
+      index[f->name] = i;
+      layout.push_back(std::move(f));
+    }
+    fields = std::move(layout);
+    instance_size = (instance_size + alignment - 1) / alignment * alignment;
+    trivial_copy = trivial_dispose = zero_init = true;
+    for (auto& f : fields) {
+      trivial_copy = trivial_copy && f->type->is_trivially_copyable();
+      trivial_dispose = trivial_dispose && f->type->is_trivially_destructible();
+      zero_init = zero_init && f->type->is_zero_initializable();
     }
   }
 
+  bool is_trivially_copyable() override { return trivial_copy; }
+  bool is_trivially_destructible() override { return trivial_dispose; }
+  bool is_zero_initializable() override { return zero_init; }
+
   void init(char* data) override {
+    if (zero_init) {
+      memset(data, 0, instance_size);
+      return;
+    }
     for (auto& f : fields){
-      f.second->type->init(f.second->get_data(data));
+      f->type->init(f->get_data(data));
     }
   }
 
   void dispose(char* data) override {
+    if (trivial_dispose)
+      return;
     for (auto& f : fields){
-      f.second->type->dispose(f.second->get_data(data));
+      f->type->dispose(f->get_data(data));
     }
   }
 
   void move(char* src, char* dst) override {
+    if (trivial_copy) {
+      memcpy(dst, src, instance_size);
+      return;
+    }
     for (auto& f : fields) {
-      f.second->type->move(f.second->get_data(src), f.second->get_data(dst));
+      f->type->move(f->get_data(src), f->get_data(dst));
     }
   };
 
   void copy(char* src, char* dst) override {
+    if (trivial_copy) {
+      memcpy(dst, src, instance_size);
+      return;
+    }
     for (auto& f : fields) {
-      f.second->type->copy(f.second->get_data(src), f.second->get_data(dst));
+      f->type->copy(f->get_data(src), f->get_data(dst));
     }
   };
 
   pin<Name> get_name() override { return name; }
 
+  // In declaration order.
   void for_fields(function<void(pin<FieldInfo>)> action) override {
-    for (const auto& f : fields)
-      action(f.second);
+    for (size_t i : declared)
+      action(fields[i]);
   }
 
   size_t get_fields_count() override { return fields.size(); }
 
   pin<FieldInfo> get_field(pin<Name> name) override {
-    auto it = fields.find(name);
-    return it == fields.end() ? FieldInfo::empty : it->second;
+    auto it = index.find(name);
+    return it == index.end() ? FieldInfo::empty : fields[it->second];
   }
 
   pin<DomItem> create_instance() override {
@@ -324,11 +510,279 @@ public:
 
 protected:
   own<Name> name;
-  unordered_map<own<Name>, own<FieldInfo>> fields;
+  // In layout order.
+  vector<own<FieldInfo>> fields;
+  // Positions in fields, in declaration order.
+  vector<size_t> declared;
+  unordered_map<own<Name>, size_t> index;
   size_t instance_size;
+  size_t alignment;
+  bool trivial_copy;
+  bool trivial_dispose;
+  bool zero_init;
   LTM_COPYABLE(StructType)
 };
 
+// Element of a SoaArrayType, its fields live in separate columns.
+struct ElementRef {
+  char* block;
+  size_t capacity;
+  size_t index;
+};
+
+class ColumnFieldInfo : public FieldInfo
+{
+public:
+  ColumnFieldInfo(pin<Name> name, pin<TypeInfo> type, ptrdiff_t column_offset)
+    : FieldInfo(name, type), size(type->get_size()) { offset = column_offset; }
+
+  char* get_data(char* element) override {
+    ElementRef* r = reinterpret_cast<ElementRef*>(element);
+    return r->block + r->capacity * offset + r->index * size;
+  }
+
+  bool has_fixed_offset() override { return false; }
+
+  // Column start relative to the block of the given capacity.
+  ptrdiff_t get_column_offset(size_t capacity) { return capacity * offset; }
+
+  const size_t size;
+  LTM_COPYABLE(ColumnFieldInfo)
+};
+
+// Struct type as seen through ElementRef proxies.
+class ColumnStructType : public TypeInfo
+{
+public:
+  ColumnStructType(pin<TypeInfo> struct_type)
+    : name(struct_type->get_name())
+  {
+    struct_type->for_fields([&](pin<FieldInfo> f) {
+      pin<ColumnFieldInfo> field = new ColumnFieldInfo(f->name, f->type, f->offset);
+      index[f->name] = fields.size();
+      fields.push_back(field);
+    });
+  }
+
+  Type get_type() override { return STRUCT; }
+  size_t get_size() override { return sizeof(ElementRef); }
+  size_t get_alignment() override { return alignof(ElementRef); }
+
+  void init(char* data) override {
+    for (auto& f : fields)
+      f->type->init(f->get_data(data));
+  }
+
+  void dispose(char* data) override {
+    for (auto& f : fields)
+      f->type->dispose(f->get_data(data));
+  }
+
+  void move(char* src, char* dst) override {
+    for (auto& f : fields)
+      f->type->move(f->get_data(src), f->get_data(dst));
+  }
+
+  void copy(char* src, char* dst) override {
+    for (auto& f : fields)
+      f->type->copy(f->get_data(src), f->get_data(dst));
+  }
+
+  pin<Name> get_name() override { return name; }
+
+  void for_fields(function<void(pin<FieldInfo>)> action) override {
+    for (auto& f : fields)
+      action(f);
+  }
+
+  size_t get_fields_count() override { return fields.size(); }
+
+  pin<FieldInfo> get_field(pin<Name> name) override {
+    auto it = index.find(name);
+    return it == index.end() ? FieldInfo::empty : fields[it->second];
+  }
+
+  pin<ColumnFieldInfo> get_column(const pin<Name>& name) {
+    auto it = index.find(name);
+    return it == index.end() ? nullptr : fields[it->second];
+  }
+
+  own<Name> name;
+  // In declaration order.
+  vector<own<ColumnFieldInfo>> fields;
+  unordered_map<own<Name>, size_t> index;
+  LTM_COPYABLE(ColumnStructType)
+};
+
+// Var array of structs, that stores each field in its own column:
+// block[capacity * field_offset + index * field_size]. Struct fields have
+// no padding between them, so columns are adjacent and aligned.
+class SoaArrayType : public TypeInfo
+{
+  struct Data{
+    size_t count;
+    size_t capacity;
+    char* block;
+    ElementRef* proxies;  // built on first get_element_ptr
+  };
+public:
+  SoaArrayType(pin<TypeInfo> struct_type)
+    : element_type(new ColumnStructType(struct_type))
+    , row_size(0)
+  {
+    for (auto& f : element_type->fields) {
+      columns.emplace_back(f->type);
+      row_size = std::max(row_size, size_t(f->get_column_offset(1)) + f->size);
+    }
+  }
+
+  size_t get_size() override { return sizeof(Data); }
+  bool is_zero_initializable() override { return true; }  // empty
+  size_t get_alignment() override { return alignof(Data); }
+
+  Type get_type() override { return TypeInfo::VAR_ARRAY; }
+
+  pin<TypeInfo> get_element_type() override { return element_type; }
+  size_t get_elements_count(char* data) override { return reinterpret_cast<Data*>(data)->count; }
+  size_t get_capacity(char* data) override { return reinterpret_cast<Data*>(data)->capacity; }
+
+  char* get_column_data(const pin<FieldInfo>& field, char* data) override {
+    auto column = element_type->get_column(field->name);
+    if (!column) {
+      report_error("no such column");
+      return nullptr;
+    }
+    // Same named fields of other structs can have other types.
+    if (column->type != field->type) {
+      report_error("column type mismatch");
+      return nullptr;
+    }
+    Data* d = reinterpret_cast<Data*>(data);
+    return d->block + column->get_column_offset(d->capacity);
+  }
+
+  void init(char* data) override {
+    *reinterpret_cast<Data*>(data) = Data{0, 0, nullptr, nullptr};
+  }
+
+  void dispose(char* data) override {
+    Data* d = reinterpret_cast<Data*>(data);
+    for (size_t i = 0; i < columns.size(); i++)
+      columns[i].dispose(column(d, i), d->count);
+    delete[] d->block;
+    delete[] d->proxies;
+  };
+
+  // Proxies point to the block, so they survive the move.
+  void move(char* src, char* dst) override {
+    *reinterpret_cast<Data*>(dst) = *reinterpret_cast<Data*>(src);
+    init(src);
+  };
+
+  void copy(char* src, char* dst) override {
+    Data* s = reinterpret_cast<Data*>(src);
+    Data t{s->count, s->count, s->count ? new char[row_size * s->count] : nullptr, nullptr};
+    for (size_t i = 0; i < columns.size(); i++)
+      columns[i].copy(column(s, i), column(&t, i), s->count);
+    *reinterpret_cast<Data*>(dst) = t;
+  };
+
+  // Proxies are valid until the next reallocation.
+  char* get_element_ptr(size_t index, char* data) override {
+    Data* d = reinterpret_cast<Data*>(data);
+    if (index >= d->count)
+      return nullptr;
+    if (!d->proxies) {
+      d->proxies = new ElementRef[d->capacity];
+      for (size_t i = 0; i < d->capacity; i++)
+        d->proxies[i] = ElementRef{d->block, d->capacity, i};
+    }
+    return reinterpret_cast<char*>(d->proxies + index);
+  }
+
+  void set_elements_count(size_t count, char* data) override {
+    Data* v = reinterpret_cast<Data*>(data);
+    if (count > v->count) {
+      grow(v, count);
+      for (size_t i = 0; i < columns.size(); i++)
+        columns[i].init(item(v, i, v->count), count - v->count);
+    } else {
+      for (size_t i = 0; i < columns.size(); i++)
+        columns[i].dispose(item(v, i, count), v->count - count);
+    }
+    v->count = count;
+  }
+
+  void reserve(size_t capacity, char* data) override {
+    Data* v = reinterpret_cast<Data*>(data);
+    if (capacity > v->capacity)
+      reallocate(v, capacity);
+  }
+
+  void shrink_to_fit(char* data) override {
+    Data* v = reinterpret_cast<Data*>(data);
+    if (v->capacity > v->count)
+      reallocate(v, v->count);
+  }
+
+  char* insert_elements(size_t index, size_t count, char* data) override {
+    Data* v = reinterpret_cast<Data*>(data);
+    if (index > v->count) {
+      report_error("insert_elements index out of range");
+      return nullptr;
+    }
+    grow(v, v->count + count);
+    for (size_t i = 0; i < columns.size(); i++) {
+      columns[i].move(item(v, i, index), item(v, i, index + count), v->count - index);
+      columns[i].init(item(v, i, index), count);
+    }
+    v->count += count;
+    return get_element_ptr(index, data);
+  }
+
+  void erase_elements(size_t index, size_t count, char* data) override {
+    Data* v = reinterpret_cast<Data*>(data);
+    if (index > v->count || count > v->count - index) {
+      report_error("erase_elements range out of bounds");
+      return;
+    }
+    for (size_t i = 0; i < columns.size(); i++) {
+      columns[i].dispose(item(v, i, index), count);
+      columns[i].move(item(v, i, index + count), item(v, i, index), v->count - index - count);
+    }
+    v->count -= count;
+  }
+
+protected:
+  char* column(Data* v, size_t i) {
+    return v->block + element_type->fields[i]->get_column_offset(v->capacity);
+  }
+
+  char* item(Data* v, size_t i, size_t index) {
+    return column(v, i) + index * columns[i].size;
+  }
+
+  void grow(Data* v, size_t count) {
+    if (count > v->capacity)
+      reallocate(v, std::max(count, v->capacity * 2));
+  }
+
+  void reallocate(Data* v, size_t capacity) {
+    Data t{v->count, capacity, capacity ? new char[capacity * row_size] : nullptr, nullptr};
+    for (size_t i = 0; i < columns.size(); i++)
+      columns[i].move(column(v, i), column(&t, i), v->count);
+    delete[] v->block;
+    delete[] v->proxies;
+    *v = t;
+  }
+
+  own<ColumnStructType> element_type;
+  // Parallel to element_type->fields.
+  vector<Items> columns;
+  size_t row_size;
+  LTM_COPYABLE(SoaArrayType)
+};
+
 Dom::Dom()
   : atom_type(new AtomType)
   , bool_type(new BoolType)
@@ -378,6 +832,19 @@ pin<TypeInfo> Dom::get_type(TypeInfo::Type type, size_t size, pin<TypeInfo> item
         result = new VarArrayType(item);
       return result;
     }
+  case TypeInfo::SOA_ARRAY: {
+      // Other elements have a single column already.
+      if (!item || item->get_type() != TypeInfo::STRUCT)
+        return get_type(TypeInfo::VAR_ARRAY, size, item);
+      if (sealed) {
+        auto it = soa_arrays.find(item);
+        return it == soa_arrays.end() ? TypeInfo::empty : it->second;
+      }
+      auto& result = soa_arrays[item];
+      if (!result)
+        result = new SoaArrayType(item);
+      return result;
+    }
   case TypeInfo::FIX_ARRAY: {
       if (sealed) {
         auto it = fixed_arrays.find(item);
@@ -404,17 +871,8 @@ void Dom::set_name(pin<DomItem> item, pin<Name> name) {
 }
 
 pin<Name> Dom::get_name(pin<DomItem> p) {
-  if (!p.has_weak())
-    return nullptr;
-  auto it = object_names.find(p);
-  if (it == object_names.end())
-    return nullptr;
-  if (!it->first) {
-    named_objects.erase(it->second);
-    object_names.erase(it);
-    return nullptr;
-  }
-  return it->second;
+  own<Name>* name = object_names.find(p);
+  return name ? *name : nullptr;
 }
 
 pin<DomItem> Dom::get_named(const pin<Name>& name) {
@@ -422,7 +880,6 @@ pin<DomItem> Dom::get_named(const pin<Name>& name) {
   if (it == named_objects.end())
     return nullptr;
   if (!it->second) {
-    object_names.erase(it->second);
     named_objects.erase(it);
     return nullptr;
   }
@@ -445,6 +902,11 @@ pin<TypeInfo> Dom::get_struct_type(pin<Name> name, vector<pin<FieldInfo>>& field
   auto& result = named_types[name];
   if (!result) {
     result = new StructType(name, fields);
+    // Rejected duplicates don't get offsets.
+    for (auto& field : fields) {
+      if (result->get_field(field->name) != field)
+        field = FieldInfo::empty;
+    }
   } else {
     for (auto& field : fields)
       field = result->get_field(field->name);
@@ -457,6 +919,10 @@ class EmptyTypeInfo : public TypeInfo
 public:
   virtual Type get_type() { return EMPTY; }
   virtual size_t get_size() { return 0;}
+  virtual size_t get_alignment() { return 1; }
+  virtual bool is_trivially_copyable() { return true; }
+  virtual bool is_trivially_destructible() { return true; }
+  virtual bool is_zero_initializable() { return true; }
   virtual void init(char*){}
   virtual void move(char* src, char* dst) {}
   virtual void copy(char* src, char* dst) {}
@@ -474,6 +940,7 @@ const own<FieldInfo> FieldInfo::empty = new FieldInfo(nullptr, TypeInfo::empty);
 #ifdef WITH_TESTS
 
 #include <limits>
+#include <numeric>
 #include "testing/base/public/gunit.h"
 
 namespace {
@@ -484,6 +951,7 @@ using ltm::weak;
 using ltm::Object;
 using dom::PtrType;
 using dom::DomItem;
+using dom::Name;
 using dom::Dom;
 using dom::TypeInfo;
 using dom::FieldInfo;
@@ -646,6 +1114,265 @@ TEST(Dom, DoubledStruct) {
   EXPECT_TRUE(fields2[2] == fields[0]);
 }
 
+TEST(Dom, VarArrayCapacity) {
+  auto dom = pin<Dom>::make();
+  auto str_type = dom->get_type(TypeInfo::STRING);
+  auto array_type = dom->get_type(TypeInfo::VAR_ARRAY, 0, str_type);
+  vector<char> data(array_type->get_size());
+  array_type->init(data.data());
+  size_t reallocations = 0;
+  for (int i = 0; i < 1000; i++) {
+    size_t capacity = array_type->get_capacity(data.data());
+    str_type->set_string(std::to_string(i), array_type->append_element(data.data()));
+    if (array_type->get_capacity(data.data()) != capacity)
+      reallocations++;
+  }
+  EXPECT_EQ(array_type->get_elements_count(data.data()), 1000);
+  EXPECT_LE(reallocations, 11);
+  EXPECT_EQ(str_type->get_string(array_type->get_element_ptr(999, data.data())), "999");
+  str_type->set_string("x", array_type->insert_elements(1, 2, data.data()));
+  EXPECT_EQ(array_type->get_elements_count(data.data()), 1002);
+  EXPECT_EQ(str_type->get_string(array_type->get_element_ptr(0, data.data())), "0");
+  EXPECT_EQ(str_type->get_string(array_type->get_element_ptr(1, data.data())), "x");
+  EXPECT_EQ(str_type->get_string(array_type->get_element_ptr(2, data.data())), "");
+  EXPECT_EQ(str_type->get_string(array_type->get_element_ptr(3, data.data())), "1");
+  array_type->erase_elements(0, 3, data.data());
+  EXPECT_EQ(str_type->get_string(array_type->get_element_ptr(0, data.data())), "1");
+  EXPECT_EQ(str_type->get_string(array_type->get_element_ptr(998, data.data())), "999");
+  array_type->set_elements_count(10, data.data());
+  EXPECT_GE(array_type->get_capacity(data.data()), 999);
+  array_type->shrink_to_fit(data.data());
+  EXPECT_EQ(array_type->get_capacity(data.data()), 10);
+  array_type->reserve(100, data.data());
+  EXPECT_EQ(array_type->get_capacity(data.data()), 100);
+  EXPECT_EQ(str_type->get_string(array_type->get_element_ptr(9, data.data())), "10");
+  array_type->dispose(data.data());
+
+  auto int_type = dom->get_type(TypeInfo::INT, 8);
+  auto ints_type = dom->get_type(TypeInfo::VAR_ARRAY, 0, int_type);
+  vector<pin<FieldInfo>> fields{
+    pin<FieldInfo>::make(dom->names()->get_or_create("ints"), ints_type)};
+  auto struct_type = dom->get_struct_type(dom->names()->get_or_create("Ints"), fields);
+  own<DomItem> item = struct_type->create_instance();
+  char* ints = fields[0]->get_data(Dom::get_data(item));
+  for (int i = 0; i < 5; i++)
+    int_type->set_int(i, ints_type->append_element(ints));
+  ints_type->erase_elements(1, 1, ints);
+  int_type->set_int(9, ints_type->insert_elements(0, 1, ints));
+  own<DomItem> copy = item;
+  char* copied = fields[0]->get_data(Dom::get_data(copy));
+  EXPECT_EQ(ints_type->get_elements_count(copied), 5);
+  EXPECT_EQ(ints_type->get_capacity(copied), 5);
+  EXPECT_EQ(int_type->get_int(ints_type->get_element_ptr(0, copied)), 9);
+  EXPECT_EQ(int_type->get_int(ints_type->get_element_ptr(2, copied)), 2);
+}
+
+TEST(Dom, StructLayout) {
+  auto dom = pin<Dom>::make();
+  vector<pin<FieldInfo>> fields{
+    pin<FieldInfo>::make(dom->names()->get_or_create("flag"), dom->get_type(TypeInfo::BOOL)),
+    pin<FieldInfo>::make(dom->names()->get_or_create("id"), dom->get_type(TypeInfo::INT, 8)),
+    pin<FieldInfo>::make(dom->names()->get_or_create("count"), dom->get_type(TypeInfo::INT, 4)),
+    pin<FieldInfo>::make(dom->names()->get_or_create("name"), dom->get_type(TypeInfo::STRING)),
+    pin<FieldInfo>::make(dom->names()->get_or_create("byte"), dom->get_type(TypeInfo::UINT, 1))};
+  auto struct_type = dom->get_struct_type(dom->names()->get_or_create("Packed"), fields);
+  EXPECT_EQ(struct_type->get_alignment(), alignof(std::string));
+  size_t size = 0;
+  for (auto& f : fields) {
+    auto data = f->get_data(nullptr) - static_cast<char*>(nullptr);
+    EXPECT_EQ(data % f->type->get_alignment(), 0);
+    size += f->type->get_size();
+  }
+  EXPECT_EQ(struct_type->get_size(), (size + 7) / 8 * 8);
+  EXPECT_EQ(struct_type->get_size() % struct_type->get_alignment(), 0);
+  vector<pin<FieldInfo>> declared;
+  struct_type->for_fields([&](pin<FieldInfo> f) { declared.push_back(f); });
+  EXPECT_TRUE(declared == fields);
+  EXPECT_TRUE(struct_type->get_field(dom->names()->get_or_create("count")) == fields[2]);
+  own<DomItem> item = struct_type->create_instance();
+  fields[3]->type->set_string("x", fields[3]->get_data(Dom::get_data(item)));
+  fields[1]->type->set_int(-1, fields[1]->get_data(Dom::get_data(item)));
+  own<DomItem> copy = item;
+  EXPECT_EQ(fields[3]->type->get_string(fields[3]->get_data(Dom::get_data(copy))), "x");
+  EXPECT_EQ(fields[1]->type->get_int(fields[1]->get_data(Dom::get_data(copy))), -1);
+}
+
+TEST(Dom, DuplicateFields) {
+  auto dom = pin<Dom>::make();
+  vector<pin<FieldInfo>> fields{
+    pin<FieldInfo>::make(dom->names()->get_or_create("x"), dom->get_type(TypeInfo::INT, 8)),
+    pin<FieldInfo>::make(dom->names()->get_or_create("y"), dom->get_type(TypeInfo::INT, 8)),
+    pin<FieldInfo>::make(dom->names()->get_or_create("x"), dom->get_type(TypeInfo::STRING))};
+  auto struct_type = dom->get_struct_type(dom->names()->get_or_create("Point"), fields);
+  EXPECT_EQ(struct_type->get_fields_count(), 2);
+  EXPECT_EQ(struct_type->get_size(), 16);
+  EXPECT_TRUE(struct_type->get_field(dom->names()->get_or_create("x"))->type == dom->get_type(TypeInfo::INT, 8));
+  EXPECT_TRUE(fields[2] == FieldInfo::empty);
+}
+
+TEST(Dom, TrivialTypes) {
+  auto dom = pin<Dom>::make();
+  auto int_type = dom->get_type(TypeInfo::INT, 4);
+  auto str_type = dom->get_type(TypeInfo::STRING);
+  EXPECT_TRUE(int_type->is_trivially_copyable());
+  EXPECT_TRUE(int_type->is_zero_initializable());
+  EXPECT_FALSE(str_type->is_trivially_copyable());
+  EXPECT_FALSE(dom->get_type(TypeInfo::OWN)->is_trivially_destructible());
+  EXPECT_TRUE(dom->get_type(TypeInfo::WEAK)->is_zero_initializable());
+  vector<pin<FieldInfo>> fields{
+    pin<FieldInfo>::make(dom->names()->get_or_create("x"), int_type),
+    pin<FieldInfo>::make(dom->names()->get_or_create("y"), dom->get_type(TypeInfo::FLOAT, 8))};
+  auto point_type = dom->get_struct_type(dom->names()->get_or_create("Point"), fields);
+  auto points_type = dom->get_type(TypeInfo::FIX_ARRAY, 4, point_type);
+  EXPECT_TRUE(points_type->is_trivially_copyable());
+  EXPECT_TRUE(points_type->is_zero_initializable());
+  vector<pin<FieldInfo>> named_fields{
+    pin<FieldInfo>::make(dom->names()->get_or_create("name"), str_type),
+    pin<FieldInfo>::make(dom->names()->get_or_create("points"), points_type)};
+  auto named_type = dom->get_struct_type(dom->names()->get_or_create("Named"), named_fields);
+  EXPECT_FALSE(named_type->is_trivially_copyable());
+  EXPECT_FALSE(named_type->is_zero_initializable());
+  EXPECT_TRUE(dom->get_type(TypeInfo::VAR_ARRAY, 0, int_type)->is_zero_initializable());
+
+  auto array_type = dom->get_type(TypeInfo::VAR_ARRAY, 0, int_type);
+  vector<char> data(array_type->get_size()), copy(array_type->get_size());
+  array_type->init(data.data());
+  array_type->init(copy.data());
+  array_type->set_elements_count(1000, data.data());
+  for (int i = 0; i < 1000; i++)
+    int_type->set_int(i, array_type->get_element_ptr(i, data.data()));
+  array_type->copy(data.data(), copy.data());
+  array_type->set_elements_count(1500, copy.data());
+  EXPECT_EQ(int_type->get_int(array_type->get_element_ptr(999, copy.data())), 999);
+  EXPECT_EQ(int_type->get_int(array_type->get_element_ptr(1499, copy.data())), 0);
+  array_type->dispose(data.data());
+  array_type->dispose(copy.data());
+
+  vector<char> points(points_type->get_size(), 1);
+  points_type->init(points.data());
+  auto y = fields[1];
+  char* p3 = points_type->get_element_ptr(3, points.data());
+  EXPECT_EQ(y->type->get_float(y->get_data(p3)), 0);
+  points_type->dispose(points.data());
+}
+
+TEST(Dom, SoaArrays) {
+  auto dom = pin<Dom>::make();
+  auto id_name = dom->names()->get_or_create("id");
+  auto weight_name = dom->names()->get_or_create("weight");
+  auto label_name = dom->names()->get_or_create("label");
+  vector<pin<FieldInfo>> fields{
+    pin<FieldInfo>::make(label_name, dom->get_type(TypeInfo::STRING)),
+    pin<FieldInfo>::make(id_name, dom->get_type(TypeInfo::INT, 4)),
+    pin<FieldInfo>::make(weight_name, dom->get_type(TypeInfo::FLOAT, 8))};
+  auto item_type = dom->get_struct_type(dom->names()->get_or_create("Item"), fields);
+  auto array_type = dom->get_type(TypeInfo::SOA_ARRAY, 0, item_type);
+  EXPECT_TRUE(array_type == dom->get_type(TypeInfo::SOA_ARRAY, 0, item_type));
+  EXPECT_TRUE(array_type != dom->get_type(TypeInfo::VAR_ARRAY, 0, item_type));
+  EXPECT_EQ(array_type->get_type(), TypeInfo::VAR_ARRAY);
+  auto int_type = dom->get_type(TypeInfo::INT, 4);
+  EXPECT_TRUE(dom->get_type(TypeInfo::SOA_ARRAY, 0, int_type) == dom->get_type(TypeInfo::VAR_ARRAY, 0, int_type));
+
+  auto element_type = array_type->get_element_type();
+  EXPECT_EQ(element_type->get_type(), TypeInfo::STRUCT);
+  EXPECT_TRUE(element_type->get_name() == item_type->get_name());
+  EXPECT_EQ(element_type->get_fields_count(), 3);
+  vector<pin<Name>> names;
+  element_type->for_fields([&](pin<FieldInfo> f) { names.push_back(f->name); });
+  EXPECT_TRUE(names == (vector<pin<Name>>{label_name, id_name, weight_name}));
+  auto id = element_type->get_field(id_name);
+  auto weight = element_type->get_field(weight_name);
+  auto label = element_type->get_field(label_name);
+
+  char data[sizeof(void*) * 4];
+  array_type->init(data);
+  for (int i = 0; i < 100; i++) {
+    char* item = array_type->append_element(data);
+    id->type->set_int(i, id->get_data(item));
+    weight->type->set_float(i * 0.5, weight->get_data(item));
+    label->type->set_string(std::to_string(i), label->get_data(item));
+  }
+  EXPECT_EQ(array_type->get_elements_count(data), 100);
+  auto ids = array_type->get_column<int32_t>(fields[1], data);
+  ASSERT_EQ(ids.size(), 100);
+  EXPECT_EQ(std::accumulate(ids.begin(), ids.end(), 0), 4950);
+  auto weights = array_type->get_column<double>(weight, data);
+  EXPECT_EQ(*std::min_element(weights.begin(), weights.end()), 0);
+  EXPECT_EQ(*std::max_element(weights.begin(), weights.end()), 49.5);
+  EXPECT_EQ(std::count_if(weights.begin(), weights.end(), [](double w) { return w >= 25; }), 50);
+  EXPECT_EQ(array_type->get_column<int64_t>(id, data).data, nullptr);
+  auto other_id = pin<FieldInfo>::make(id_name, dom->get_type(TypeInfo::FLOAT, 8));
+  EXPECT_EQ(array_type->get_column<double>(other_id, data).data, nullptr);
+  EXPECT_EQ(array_type->get_column<double>(other_id, data).size(), 0);
+
+  array_type->erase_elements(10, 80, data);
+  char* item = array_type->insert_elements(1, 1, data);
+  EXPECT_EQ(id->type->get_int(id->get_data(item)), 0);
+  EXPECT_EQ(label->type->get_string(label->get_data(item)), "");
+  label->type->set_string("new", label->get_data(item));
+  EXPECT_EQ(array_type->get_elements_count(data), 21);
+  ids = array_type->get_column<int32_t>(id, data);
+  EXPECT_EQ(ids[0], 0);
+  EXPECT_EQ(ids[2], 1);
+  EXPECT_EQ(ids[11], 90);
+  EXPECT_EQ(ids[20], 99);
+
+  char copy[sizeof(data)];
+  array_type->copy(data, copy);
+  array_type->dispose(data);
+  array_type->init(data);
+  array_type->move(copy, data);
+  array_type->dispose(copy);
+  EXPECT_EQ(array_type->get_capacity(data), 21);
+  item = array_type->get_element_ptr(1, data);
+  EXPECT_EQ(label->type->get_string(label->get_data(item)), "new");
+  item = array_type->get_element_ptr(20, data);
+  EXPECT_EQ(label->type->get_string(label->get_data(item)), "99");
+  EXPECT_EQ(weight->type->get_float(weight->get_data(item)), 49.5);
+  array_type->dispose(data);
+}
+
+TEST(Dom, FieldRefs) {
+  auto dom = pin<Dom>::make();
+  vector<pin<FieldInfo>> fields{
+    pin<FieldInfo>::make(dom->names()->get_or_create("visible"), dom->get_type(TypeInfo::BOOL)),
+    pin<FieldInfo>::make(dom->names()->get_or_create("id"), dom->get_type(TypeInfo::INT, 8)),
+    pin<FieldInfo>::make(dom->names()->get_or_create("x"), dom->get_type(TypeInfo::FLOAT, 4)),
+    pin<FieldInfo>::make(dom->names()->get_or_create("name"), dom->get_type(TypeInfo::STRING))};
+  auto node_type = dom->get_struct_type(dom->names()->get_or_create("Node"), fields);
+  dom::FieldRef<bool> visible(fields[0]);
+  dom::FieldRef<int64_t> id(fields[1]);
+  dom::FieldRef<float> x(fields[2]);
+  dom::FieldRef<std::string> name(fields[3]);
+  EXPECT_TRUE(visible && id && x && name);
+  EXPECT_FALSE(dom::FieldRef<int32_t>(fields[1]));
+  EXPECT_FALSE(dom::FieldRef<double>(fields[2]));
+  EXPECT_FALSE(dom::FieldRef<uint64_t>(fields[1]));
+  EXPECT_FALSE(dom::FieldRef<int64_t>());
+
+  auto node = node_type->create_instance();
+  char* data = Dom::get_data(node);
+  EXPECT_EQ(id.get(data), 0);
+  EXPECT_EQ(name.get(data), "");
+  id.set(data, -5);
+  x.set(data, 1.5f);
+  visible.set(data, true);
+  name.set(data, "root");
+  EXPECT_EQ(fields[1]->type->get_int(fields[1]->get_data(data)), -5);
+  EXPECT_EQ(fields[2]->type->get_float(fields[2]->get_data(data)), 1.5);
+  EXPECT_TRUE(fields[0]->type->get_bool(fields[0]->get_data(data)));
+  EXPECT_EQ(fields[3]->type->get_string(fields[3]->get_data(data)), "root");
+  fields[1]->type->set_int(42, fields[1]->get_data(data));
+  EXPECT_EQ(id.get(data), 42);
+  *id.ptr(data) += 1;
+  EXPECT_EQ(id.get(data), 43);
+
+  // Columnar elements have no fixed offset.
+  auto soa_type = dom->get_type(TypeInfo::SOA_ARRAY, 0, node_type);
+  auto column = soa_type->get_element_type()->get_field(fields[1]->name);
+  EXPECT_FALSE(dom::FieldRef<int64_t>(column));
+}
+
 TEST(Dom, Sealed) {
   auto dom = pin<Dom>::make();
   auto int_type = dom->get_type(TypeInfo::INT, 4);
@@ -8,6 +8,7 @@
 #include <unordered_map>
 #include <functional>
 #include <algorithm>
+#include <type_traits>
 #include "../ltm.h"
 
 namespace dom {
@@ -29,6 +30,19 @@ class TypeInfo;
 class FieldInfo;
 class DomItem;
 
+// Contiguous values of one field of an array of structs.
+template<typename T>
+struct Column
+{
+  T* data;
+  size_t count;
+
+  T* begin() const { return data; }
+  T* end() const { return data + count; }
+  size_t size() const { return count; }
+  T& operator[] (size_t i) const { return data[i]; }
+};
+
 class Name : public Object
 {
   friend class Dom;
@@ -42,7 +56,7 @@ protected:
   unordered_map<string, own<Name>> sub;
 
   Name(pin<Name> domain, string name)
-    : domain(domain), name(name) { make_shared(); }
+    : domain(domain), name(name) { make_shared(); make_atomic(); }
   LTM_COPYABLE(Name)
 };
 
@@ -52,21 +66,40 @@ public:
   enum Type
   {
     EMPTY, INT, UINT, FLOAT, BOOL, STRING, OWN, WEAK, VAR_ARRAY, ATOM, FIX_ARRAY, STRUCT,
+    SOA_ARRAY,  // Requested from Dom::get_type, reported as VAR_ARRAY
   };
   // all
-  TypeInfo() { make_shared(); }
+  TypeInfo() { make_shared(); make_atomic(); }
   virtual Type get_type() =0;
   virtual size_t get_size() = 0;
+  virtual size_t get_alignment() = 0;
   virtual void init(char*) = 0;
   virtual void dispose(char*) {};
   virtual void move(char* src, char* dst) = 0;
   virtual void copy(char* src, char* dst) = 0;
+  // Values that can be copied and moved by memcpy, need no dispose or are
+  // all-zero bytes when initialized. Aggregates process them in bulk.
+  virtual bool is_trivially_copyable() { return false; }
+  virtual bool is_trivially_destructible() { return false; }
+  virtual bool is_zero_initializable() { return false; }
 
   // array
   virtual pin<TypeInfo> get_element_type(){ report_error("unsupported get_element_type"); return empty; }
   virtual char* get_element_ptr(size_t index, char*){ report_error("unsupported get_element"); return nullptr; }
   virtual size_t get_elements_count(char*){ report_error("unsupported get_elements_count"); return 0; }
   virtual void set_elements_count(size_t count, char*){ report_error("unsupported set_elements_count"); }
+  // var array, grows geometrically
+  virtual size_t get_capacity(char*){ report_error("unsupported get_capacity"); return 0; }
+  virtual void reserve(size_t /*capacity*/, char*){ report_error("unsupported reserve"); }
+  virtual void shrink_to_fit(char*){ report_error("unsupported shrink_to_fit"); }
+  // Inserts default elements before index, returns the first one.
+  virtual char* insert_elements(size_t /*index*/, size_t /*count*/, char*){ report_error("unsupported insert_elements"); return nullptr; }
+  virtual void erase_elements(size_t /*index*/, size_t /*count*/, char*){ report_error("unsupported erase_elements"); }
+  char* append_element(char* data) { return insert_elements(get_elements_count(data), 1, data); }
+  // soa array, first value of the field column
+  virtual char* get_column_data(const pin<FieldInfo>& /*field*/, char*){ report_error("unsupported get_column_data"); return nullptr; }
+  template<typename T>
+  Column<T> get_column(const pin<FieldInfo>& field, char* data);
   // struct
   virtual pin<Name> get_name() { report_error("unsupported get_name"); return nullptr; }
   virtual void for_fields(function<void(pin<FieldInfo>)>){ report_error("unsupported for_fields"); }
@@ -96,9 +129,13 @@ public:
 class FieldInfo : public Object
 {
   friend class StructType;
+  friend class ColumnStructType;
+  template<typename T> friend class FieldRef;
 public:
-  FieldInfo(pin<Name> name, pin<TypeInfo> type) : name(name), type(type) {}
+  FieldInfo(pin<Name> name, pin<TypeInfo> type) : name(name), type(type) { make_atomic(); }
   virtual char* get_data(char* struct_ptr){ return struct_ptr + offset; }
+  // If get_data is struct_ptr + offset.
+  virtual bool has_fixed_offset() { return true; }
 
   const own<Name> name;
   const own<TypeInfo> type;
@@ -109,6 +146,55 @@ protected:
   LTM_COPYABLE(FieldInfo)
 };
 
+template<typename T>
+constexpr TypeInfo::Type primitive_type_of() {
+  return
+      std::is_same<T, bool>::value ? TypeInfo::BOOL :
+      std::is_same<T, string>::value ? TypeInfo::STRING :
+      std::is_floating_point<T>::value ? TypeInfo::FLOAT :
+      std::is_integral<T>::value && std::is_signed<T>::value ? TypeInfo::INT :
+      std::is_integral<T>::value ? TypeInfo::UINT :
+      TypeInfo::EMPTY;
+}
+
+template<typename T>
+Column<T> TypeInfo::get_column(const pin<FieldInfo>& field, char* data) {
+  if (field->type->get_type() != primitive_type_of<T>() || field->type->get_size() != sizeof(T)) {
+    report_error("column type mismatch");
+    return {nullptr, 0};
+  }
+  char* column = get_column_data(field, data);
+  return {reinterpret_cast<T*>(column), column ? get_elements_count(data) : 0};
+}
+
+// Field accessor, that checks the field type once when bound,
+// and then reads and writes values in place.
+//   FieldRef<int64_t> id(fields[0]);
+//   int64_t v = id.get(Dom::get_data(item));
+template<typename T>
+class FieldRef
+{
+public:
+  FieldRef() : offset(0), bound(false) {}
+  explicit FieldRef(const pin<FieldInfo>& field) : offset(field->offset), bound(false) {
+    if (field->type->get_type() == primitive_type_of<T>() &&
+        field->type->get_size() == sizeof(T) &&
+        field->has_fixed_offset())
+      bound = true;
+    else
+      field->type->report_error("field type mismatch");
+  }
+
+  explicit operator bool() const { return bound; }
+  T* ptr(char* struct_ptr) const { return reinterpret_cast<T*>(struct_ptr + offset); }
+  const T& get(char* struct_ptr) const { return *ptr(struct_ptr); }
+  void set(char* struct_ptr, T value) const { *ptr(struct_ptr) = move(value); }
+
+private:
+  ptrdiff_t offset;
+  bool bound;
+};
+
 class DomItem: public Object
 {
   friend class Dom;
@@ -135,13 +221,14 @@ public:
   
 protected:
   own<Name> root_name = new Name(nullptr, "");
-  unordered_map<weak<DomItem>, own<Name>> object_names;
+  ltm::weak_map<DomItem, own<Name>> object_names;
   unordered_map<own<Name>, weak<DomItem>> named_objects;
   own<TypeInfo> atom_type, bool_type, string_type, own_ptr_type, weak_ptr_type;
   own<TypeInfo> int8_type, int16_type, int32_type, int64_type;
   own<TypeInfo> uint8_type, uint16_type, uint32_type, uint64_type;
   own<TypeInfo> float32_type, float64_type;
   unordered_map<own<TypeInfo>, own<TypeInfo>> var_arrays;
+  unordered_map<own<TypeInfo>, own<TypeInfo>> soa_arrays;
   unordered_map<own<Name>, own<TypeInfo>> named_types;
   unordered_map<own<TypeInfo>, unordered_map<size_t, own<TypeInfo>>> fixed_arrays;
   LTM_COPYABLE(Dom)
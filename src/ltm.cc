@@ -16,16 +16,71 @@ limitations under the License.
 
 #include "ltm.h"
 
-#ifdef TESTS
+#include <algorithm>
+#include <atomic>
 #include <cassert>
-#endif  // TESTS
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 
 namespace ltm {
 
+// Used by parallel_copy and cow_edit. Weak blocks of copied objects point
+// to their copies (tagged as OBJECT), but weak fields of copies aren't
+// linked to them, instead they are recorded and fixed up at the end.
+struct CopyRecord {
+  // Originals having weak blocks (retained).
+  std::vector<Object*> objects;
+  // Weak fields of copies and the weak blocks (retained) they are copied
+  // from.
+  std::vector<std::pair<Object**, WeakBlock*>> weaks;
+};
+
+// Objects met by trial copies of debug checks.
+struct DomainCheck {
+  // Copied objects.
+  std::vector<Object*> copied;
+  // Shared objects, once per reference from the domain.
+  std::vector<Object*> shared;
+  bool pinned = false;
+};
+
 namespace {
 thread_local Object* copy_head = nullptr;
 thread_local uintptr_t copy_depth = 0;
 
+// Postponed copies of own<T> fields, each slot holds its source object.
+thread_local bool defer_copies = false;
+thread_local bool draining_copies = false;
+thread_local std::vector<Object**> deferred_copies;
+
+thread_local CopyRecord* current_record = nullptr;
+
+// Set inside of assign_into.
+thread_local bool assigning = false;
+// Nesting of assign_to calls. Deeper objects get copied instead of reused,
+// so assignments of deep hierarchies don't exhaust the stack.
+thread_local int assign_depth = 0;
+const int MAX_ASSIGN_DEPTH = 256;
+
+#ifndef NDEBUG
+thread_local DomainCheck* domain_check = nullptr;
+// Postponed copies come with one more retain.
+thread_local Object* deferred_source = nullptr;
+#endif
+
+// Threads of parallel_copy retain shared objects concurrently.
+thread_local bool force_atomic = false;
+
 // These tags are used during copy operation.
 // They mark three types of pointers.
 // 1. Object pointing to its WeakBlock
@@ -34,10 +89,13 @@ thread_local uintptr_t copy_depth = 0;
 //    (normally it points to own Object)
 // 3. Weak_ptr value (normally points to WeakBlock,
 //    But if tagged points to a next WeakPtr or next Object.
+// Objects derived from ObjectWithWeak are tagged with INLINE_OBJECT,
+// their links are stored in tombstone fields, not in counters.
 enum class Tag : intptr_t {
   WEAK_BLOCK = 0,
   OBJECT = 1,
   WEAK = 2,
+  INLINE_OBJECT = 3,
 };
 
 template <typename T>
@@ -54,19 +112,495 @@ T* untag_ptr(void* ptr) noexcept {
 Tag get_ptr_tag(void* ptr) noexcept {
   return static_cast<Tag>(reinterpret_cast<intptr_t>(ptr) & 3);
 }
+
+// Counters of atomic objects are accessed by interlocked operations.
+// Flags are never changed concurrently, so they can be read by relaxed loads.
+std::atomic<intptr_t>& as_atomic(intptr_t& counter) noexcept {
+  static_assert(sizeof(std::atomic<intptr_t>) == sizeof(intptr_t),
+                "atomic counters should have the same layout as plain ones");
+  return reinterpret_cast<std::atomic<intptr_t>&>(counter);
+}
+
+intptr_t load(intptr_t& counter) noexcept {
+  return as_atomic(counter).load(std::memory_order_relaxed);
+}
+
+// Weak block targets are accessed concurrently by threads of parallel_copy
+// and by weaks of atomic objects locked on other threads.
+std::atomic<Object*>& as_atomic(Object*& target) noexcept {
+  return reinterpret_cast<std::atomic<Object*>&>(target);
+}
+
+Object* load(Object*& target) noexcept {
+  return as_atomic(target).load(std::memory_order_relaxed);
+}
+
+// Free list of WeakBlock-sized memory chunks.
+// Chunks are carved from slabs that are never returned to the heap,
+// so a block can be freed to the pool of any thread.
+// Blocks freed above MAX_LOCAL_BLOCKS and blocks of ended threads are
+// passed in batches to the orphans list, from which other threads refill
+// their pools. So blocks allocated by one thread and freed by another
+// return to the allocating thread.
+struct FreeBlock {
+  FreeBlock* next;
+  // Valid in first blocks of orphaned batches.
+  FreeBlock* next_batch;
+  std::size_t count;
+};
+
+struct Orphans {
+  std::mutex mutex;
+  FreeBlock* batches = nullptr;
+};
+
+Orphans& get_orphans() {
+  static Orphans* orphans = new Orphans;  // never destroyed
+  return *orphans;
+}
+
+class WeakBlockPool {
+ public:
+  static const std::size_t BLOCK_SIZE = sizeof(WeakBlock);
+  static const std::size_t SLAB_BLOCKS = 64;
+  static const std::size_t MAX_LOCAL_BLOCKS = SLAB_BLOCKS * 4;
+  static_assert(sizeof(FreeBlock) <= BLOCK_SIZE,
+                "free blocks should fit in WeakBlocks");
+
+  ~WeakBlockPool() {
+    gone = true;
+    if (head)
+      give_away(head, count);
+  }
+
+  void* allocate() {
+    stats.blocks++;
+    if (!head && !adopt_orphans()) {
+      stats.slabs++;
+      char* slab = static_cast<char*>(::operator new(BLOCK_SIZE * SLAB_BLOCKS));
+      for (std::size_t i = SLAB_BLOCKS; i--; slab += BLOCK_SIZE)
+        push(slab);
+    }
+    FreeBlock* r = head;
+    head = r->next;
+    count--;
+    return r;
+  }
+
+  void free(void* ptr) noexcept {
+    push(ptr);
+    if (count > MAX_LOCAL_BLOCKS) {
+      give_away(head, count);
+      head = nullptr;
+      count = 0;
+    }
+  }
+
+  // Passes the list of blocks to orphans.
+  static void give_away(FreeBlock* first, std::size_t count) noexcept {
+    first->count = count;
+    Orphans& orphans = get_orphans();
+    std::lock_guard<std::mutex> lock(orphans.mutex);
+    first->next_batch = orphans.batches;
+    orphans.batches = first;
+  }
+
+  static thread_local bool gone;
+  WeakBlockPoolStats stats{};
+
+ private:
+  void push(void* ptr) noexcept {
+    FreeBlock* b = static_cast<FreeBlock*>(ptr);
+    b->next = head;
+    head = b;
+    count++;
+  }
+
+  bool adopt_orphans() noexcept {
+    Orphans& orphans = get_orphans();
+    std::lock_guard<std::mutex> lock(orphans.mutex);
+    head = orphans.batches;
+    if (!head)
+      return false;
+    orphans.batches = head->next_batch;
+    count = head->count;
+    return true;
+  }
+
+  FreeBlock* head = nullptr;
+  std::size_t count = 0;
+};
+
+thread_local bool WeakBlockPool::gone = false;
+thread_local WeakBlockPool weak_block_pool;
+
+// Memory of objects of arena scopes and of copies made by compact(). Chunks are aligned to their size,
+// so the chunk of an object is found by its address, and registered in
+// a table that is read without locks by operator delete.
+struct ArenaChunk {
+  static const std::size_t SIZE = std::size_t(1) << 18;
+  static const std::size_t ALIGN = 16;
+  // More than the chunk can hold, so allocations don't touch the atomic
+  // counter: it's biased by FILLING - objects until the chunk is closed.
+  static const std::size_t FILLING = SIZE / ALIGN;
+  // Objects in the chunk.
+  std::atomic<std::size_t> live;
+  // Objects allocated, accessed by the filling thread.
+  std::size_t objects;
+  char* next;
+  char* end;
+
+  static ArenaChunk* create() noexcept;
+  static ArenaChunk* find(void* ptr) noexcept;
+  std::size_t live_objects() noexcept {
+    return live.load(std::memory_order_acquire) - (FILLING - objects);
+  }
+  // Ends filling, recycles the chunk if its objects are already gone.
+  void close() noexcept { release(FILLING - objects); }
+  void unref() noexcept { release(1); }
+  void release(std::size_t n) noexcept;
+};
+
+const std::size_t ARENA_TABLE_SIZE = 4096;
+const std::uintptr_t REMOVED_CHUNK = 1;
+// Open addressing, zero is an empty slot.
+std::atomic<std::uintptr_t> arena_table[ARENA_TABLE_SIZE];
+std::atomic<std::size_t> arena_chunks{0};
+// Guards the table and the spare chunks.
+std::mutex arena_table_mutex;
+
+// Empty chunks kept registered for reuse, so short arena scopes don't map
+// and fault in fresh memory.
+const std::size_t MAX_SPARE_CHUNKS = 16;
+std::vector<ArenaChunk*>& spare_chunks() {
+  static auto* spare = new std::vector<ArenaChunk*>;
+  return *spare;
+}
+
+std::size_t arena_slot(std::uintptr_t chunk) noexcept {
+  return (chunk / ArenaChunk::SIZE) % ARENA_TABLE_SIZE;
+}
+
+void* aligned_chunk_alloc() noexcept {
+#ifdef _WIN32
+  return _aligned_malloc(ArenaChunk::SIZE, ArenaChunk::SIZE);
+#else
+  void* r;
+  return posix_memalign(&r, ArenaChunk::SIZE, ArenaChunk::SIZE) ? nullptr : r;
+#endif
+}
+
+void aligned_chunk_free(void* ptr) noexcept {
+#ifdef _WIN32
+  _aligned_free(ptr);
+#else
+  std::free(ptr);
+#endif
+}
+
+// Allocates and registers memory of a new chunk.
+void* new_chunk_memory() noexcept {
+  void* mem = aligned_chunk_alloc();
+  if (!mem)
+    return nullptr;
+  std::uintptr_t key = reinterpret_cast<std::uintptr_t>(mem);
+  {
+    std::lock_guard<std::mutex> lock(arena_table_mutex);
+    // Keep the table sparse, further copies go to the heap.
+    if (arena_chunks.load(std::memory_order_relaxed) < ARENA_TABLE_SIZE / 2) {
+      std::size_t i = arena_slot(key);
+      while (arena_table[i].load(std::memory_order_relaxed) > REMOVED_CHUNK)
+        i = (i + 1) % ARENA_TABLE_SIZE;
+      arena_table[i].store(key, std::memory_order_release);
+      arena_chunks.fetch_add(1, std::memory_order_relaxed);
+      return mem;
+    }
+  }
+  aligned_chunk_free(mem);
+  return nullptr;
+}
+
+/* static */
+ArenaChunk* ArenaChunk::create() noexcept {
+  ArenaChunk* c = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(arena_table_mutex);
+    std::vector<ArenaChunk*>& spare = spare_chunks();
+    if (!spare.empty()) {
+      c = spare.back();
+      spare.pop_back();
+    }
+  }
+  if (!c) {
+    void* mem = new_chunk_memory();
+    if (!mem)
+      return nullptr;
+    c = new (mem) ArenaChunk;
+  }
+  c->live.store(FILLING, std::memory_order_relaxed);
+  c->objects = 0;
+  c->next = reinterpret_cast<char*>(c) +
+            (sizeof(ArenaChunk) + ALIGN - 1) / ALIGN * ALIGN;
+  c->end = reinterpret_cast<char*>(c) + SIZE;
+  return c;
+}
+
+/* static */
+ArenaChunk* ArenaChunk::find(void* ptr) noexcept {
+  if (!arena_chunks.load(std::memory_order_relaxed))
+    return nullptr;
+  std::uintptr_t key = reinterpret_cast<std::uintptr_t>(ptr) & ~(SIZE - 1);
+  std::size_t i = arena_slot(key);
+  for (std::size_t n = 0; n < ARENA_TABLE_SIZE; n++) {
+    std::uintptr_t v = arena_table[i].load(std::memory_order_acquire);
+    if (v == key)
+      return reinterpret_cast<ArenaChunk*>(key);
+    if (!v)
+      break;
+    i = (i + 1) % ARENA_TABLE_SIZE;
+  }
+  return nullptr;
+}
+
+void ArenaChunk::release(std::size_t n) noexcept {
+  if (live.fetch_sub(n, std::memory_order_acq_rel) != n)
+    return;
+  std::uintptr_t key = reinterpret_cast<std::uintptr_t>(this);
+  {
+    std::lock_guard<std::mutex> lock(arena_table_mutex);
+    std::vector<ArenaChunk*>& spare = spare_chunks();
+    if (spare.size() < MAX_SPARE_CHUNKS) {
+      try {
+        spare.push_back(this);
+        return;
+      } catch (...) {
+      }
+    }
+    std::size_t i = arena_slot(key);
+    while (arena_table[i].load(std::memory_order_relaxed) != key)
+      i = (i + 1) % ARENA_TABLE_SIZE;
+    arena_table[i].store(REMOVED_CHUNK, std::memory_order_relaxed);
+    arena_chunks.fetch_sub(1, std::memory_order_relaxed);
+  }
+  this->~ArenaChunk();
+  aligned_chunk_free(this);
+}
+
+// Chunks being filled by compact() or an arena scope on this thread.
+struct Arena {
+  std::vector<ArenaChunk*> chunks;
+
+  void* allocate(std::size_t size) noexcept {
+    size = (size + ArenaChunk::ALIGN - 1) / ArenaChunk::ALIGN * ArenaChunk::ALIGN;
+    ArenaChunk* c = chunks.empty() ? nullptr : chunks.back();
+    if (!c || std::size_t(c->end - c->next) < size) {
+      if (size > ArenaChunk::SIZE / 4)
+        return nullptr;
+      try {
+        chunks.reserve(chunks.size() + 1);
+      } catch (...) {
+        return nullptr;
+      }
+      c = ArenaChunk::create();
+      if (!c)
+        return nullptr;
+      chunks.push_back(c);
+    }
+    void* r = c->next;
+    c->next += size;
+    c->objects++;
+    return r;
+  }
+
+  ~Arena() {
+    for (ArenaChunk* c : chunks)
+      c->close();
+  }
+};
+
+thread_local Arena* current_arena = nullptr;
+
+// Set by ~Object of an IN_ARENA object for the following operator delete.
+thread_local bool deleting_arena_object = false;
 }  // namespace
 
+#ifdef LTM_STATS
+namespace {
+
+enum StatId {
+  OBJECTS_CREATED,  // including weak blocks
+  OBJECTS_DISPOSED,
+  WEAK_BLOCKS_ALLOCATED,
+  WEAK_BLOCKS_FREED,
+  ADOPTED,
+  SHARED_RETAINED,
+  COPIED,  // including weak blocks
+  WEAKS_COPIED,
+  TRANSACTIONS,
+  TRANSACTION_OBJECTS,
+  STAT_COUNT
+};
+
+// Counters of one thread. They are written only by their thread, so
+// they are updated without interlocked operations.
+struct ThreadStats {
+  static thread_local bool gone;
+  std::atomic<std::int64_t> values[STAT_COUNT];
+  ThreadStats* next;
+  ThreadStats* prev;
+  // Weak blocks are copied through finalize_copy too, so this counter is
+  // incremented by objects and decremented by weak blocks.
+  std::int64_t finalized = 0;
+  std::int64_t transaction_start = 0;
+
+  ThreadStats();
+  ~ThreadStats();
+};
+thread_local bool ThreadStats::gone = false;
+
+struct StatsRegistry {
+  std::mutex mutex;
+  ThreadStats* threads = nullptr;
+  // Counters of finished threads.
+  std::int64_t retired[STAT_COUNT] = {};
+  // Counters updated at thread exit, after its ThreadStats are destroyed.
+  std::atomic<std::int64_t> late[STAT_COUNT] = {};
+  std::int64_t baseline[STAT_COUNT] = {};
+  std::atomic<std::int64_t> peak{0};
+
+  void sum(std::int64_t* dst) {
+    for (int i = 0; i < STAT_COUNT; i++)
+      dst[i] = retired[i] + late[i].load(std::memory_order_relaxed);
+    for (ThreadStats* t = threads; t; t = t->next) {
+      for (int i = 0; i < STAT_COUNT; i++)
+        dst[i] += t->values[i].load(std::memory_order_relaxed);
+    }
+  }
+};
+
+StatsRegistry& stats_registry() {
+  static StatsRegistry* r = new StatsRegistry;  // never destroyed
+  return *r;
+}
+
+ThreadStats::ThreadStats() : prev(nullptr) {
+  for (auto& v : values)
+    v.store(0, std::memory_order_relaxed);
+  StatsRegistry& r = stats_registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  next = r.threads;
+  if (next)
+    next->prev = this;
+  r.threads = this;
+}
+
+ThreadStats::~ThreadStats() {
+  StatsRegistry& r = stats_registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  for (int i = 0; i < STAT_COUNT; i++)
+    r.retired[i] += values[i].load(std::memory_order_relaxed);
+  (prev ? prev->next : r.threads) = next;
+  if (next)
+    next->prev = prev;
+  gone = true;
+}
+
+thread_local ThreadStats thread_stats;
+
+void count(StatId id, std::int64_t delta = 1) noexcept {
+  if (ThreadStats::gone) {
+    stats_registry().late[id].fetch_add(delta, std::memory_order_relaxed);
+  } else {
+    auto& v = thread_stats.values[id];
+    v.store(v.load(std::memory_order_relaxed) + delta,
+            std::memory_order_relaxed);
+  }
+}
+
+void count_finalized(std::int64_t delta) noexcept {
+  if (!ThreadStats::gone)
+    thread_stats.finalized += delta;
+}
+
+void start_transaction_stats() noexcept {
+  if (!ThreadStats::gone)
+    thread_stats.transaction_start = thread_stats.finalized;
+}
+
+void end_transaction_stats() noexcept {
+  if (ThreadStats::gone)
+    return;
+  std::int64_t n = thread_stats.finalized - thread_stats.transaction_start;
+  count(TRANSACTIONS);
+  count(TRANSACTION_OBJECTS, n);
+  auto& peak = stats_registry().peak;
+  for (std::int64_t p = peak.load(std::memory_order_relaxed);
+       n > p && !peak.compare_exchange_weak(p, n, std::memory_order_relaxed);) {
+  }
+}
+
+}  // namespace
+
+#define LTM_STAT(...) count(__VA_ARGS__)
+#define LTM_STAT_FINALIZED(delta) count_finalized(delta)
+#define LTM_STAT_TRANSACTION_START() start_transaction_stats()
+#define LTM_STAT_TRANSACTION_END() end_transaction_stats()
+
+Stats get_stats() {
+  StatsRegistry& r = stats_registry();
+  std::int64_t v[STAT_COUNT];
+  {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.sum(v);
+    for (int i = 0; i < STAT_COUNT; i++)
+      v[i] -= r.baseline[i];
+  }
+  Stats s;
+  s.objects_created = v[OBJECTS_CREATED] - v[WEAK_BLOCKS_ALLOCATED];
+  s.objects_disposed = v[OBJECTS_DISPOSED] - v[WEAK_BLOCKS_FREED];
+  s.weak_blocks_allocated = v[WEAK_BLOCKS_ALLOCATED];
+  s.weak_blocks_freed = v[WEAK_BLOCKS_FREED];
+  s.adopted = v[ADOPTED];
+  s.shared_retained = v[SHARED_RETAINED];
+  s.copied = v[COPIED] - v[WEAKS_COPIED];
+  s.weaks_copied = v[WEAKS_COPIED];
+  s.transactions = v[TRANSACTIONS];
+  s.transaction_objects = v[TRANSACTION_OBJECTS];
+  s.peak_transaction_objects = r.peak.load(std::memory_order_relaxed);
+  return s;
+}
+
+void reset_stats() {
+  StatsRegistry& r = stats_registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  r.sum(r.baseline);
+  r.peak.store(0, std::memory_order_relaxed);
+}
+
+#else
+#define LTM_STAT(...)
+#define LTM_STAT_FINALIZED(delta)
+#define LTM_STAT_TRANSACTION_START()
+#define LTM_STAT_TRANSACTION_END()
+#endif  // LTM_STATS
+
 Object::Object() noexcept {
-  counter = WEAKLESS;
+  counter = WEAKLESS | arena_flag();
+  LTM_STAT(OBJECTS_CREATED);
 }
 
 Object::Object(const Object&) noexcept {
-  counter = COUNTER_STEP | OWNED | WEAKLESS;
+  counter = COUNTER_STEP | OWNED | WEAKLESS | arena_flag();
+  LTM_STAT(OBJECTS_CREATED);
 }
 
 Object::~Object() noexcept {
+  LTM_STAT(OBJECTS_DISPOSED);
+  if (load(get_counter()) & IN_ARENA)
+    deleting_arena_object = true;
   if ((counter & WEAKLESS) == 0) {
-    weak_block->target = nullptr;
+    // Atomic objects can be locked by weaks on other threads.
+    as_atomic(weak_block->target).store(nullptr, std::memory_order_relaxed);
     release(weak_block);
   }
 }
@@ -78,25 +612,650 @@ Object* Object::get_weak(Object* me) {
 
 /*static*/
 Object* Object::get_target(Object* me) noexcept {
-  return me ? me->get_target() : nullptr;
+  if (!me)
+    return nullptr;
+  return me->is_weak_block() ? load(static_cast<WeakBlock*>(me)->target)
+                             : me->get_target();
+}
+
+/*static*/
+Object* Object::lock(Object* me) noexcept {
+  if (!me)
+    return nullptr;
+  if (!me->is_weak_block())  // proxy
+    return retain(me->get_target());
+  Object* target = load(static_cast<WeakBlock*>(me)->target);
+  if (!target)  // lost
+    return nullptr;
+  intptr_t& counter = static_cast<WeakBlock*>(me)->org_counter;
+  if ((load(counter) & ATOMIC) == 0)
+    return retain(target);
+  // Target can be disposed on other thread, retain it only if it is alive.
+  for (intptr_t c = load(counter); c >= COUNTER_STEP;) {
+    if (as_atomic(counter).compare_exchange_weak(c, c + COUNTER_STEP,
+                                                 std::memory_order_acquire,
+                                                 std::memory_order_relaxed))
+      return target;
+  }
+  return nullptr;
+}
+
+intptr_t& Object::get_counter() noexcept {
+  return load(counter) & WEAKLESS ? counter : weak_block->org_counter;
+}
+
+/*static*/
+void Object::add_to_counter(intptr_t& counter, intptr_t delta) noexcept {
+  if (load(counter) & ATOMIC || force_atomic)
+    as_atomic(counter).fetch_add(delta, std::memory_order_relaxed);
+  else
+    counter += delta;
+}
+
+/*static*/
+intptr_t Object::sub_from_counter(intptr_t& counter, intptr_t delta) noexcept {
+  if (load(counter) & ATOMIC || force_atomic)
+    return as_atomic(counter).fetch_sub(delta, std::memory_order_acq_rel) -
+           delta;
+  return counter -= delta;
 }
 
 /*static*/
 Object* Object::retain(Object* me) noexcept {
   if (me)
-    (me->counter & WEAKLESS ? me->counter : me->weak_block->org_counter) +=
-        COUNTER_STEP;
+    add_to_counter(me->get_counter(), COUNTER_STEP);
   return me;
 }
 
 /*static*/
 void Object::release(Object* me) noexcept {
-  if (!me)
+  if (me && sub_from_counter(me->get_counter(), COUNTER_STEP) < COUNTER_STEP)
+    dispose(me);
+}
+
+namespace {
+
+struct DisposeQueue {
+  static thread_local bool gone;
+  bool disposing = false;
+  std::vector<Object*> objects;
+  ~DisposeQueue() { gone = true; }
+};
+thread_local bool DisposeQueue::gone = false;
+thread_local DisposeQueue dispose_queue;
+
+}  // namespace
+
+/*static*/
+void Object::dispose(Object* me) noexcept {
+  if (DisposeQueue::gone) {
+    me->internal_dispose();
     return;
-  intptr_t& counter =
-      me->counter & WEAKLESS ? me->counter : me->weak_block->org_counter;
-  if ((counter -= COUNTER_STEP) < COUNTER_STEP)
+  }
+  DisposeQueue& q = dispose_queue;
+  if (q.disposing) {
+    // Weak pointers must not reach the queued object.
+    if (WeakBlock* wb = me->find_weak_block())
+      as_atomic(wb->target).store(nullptr, std::memory_order_relaxed);
+    try {
+      q.objects.push_back(me);
+      return;
+    } catch (...) {
+      // Out of memory, dispose it recursively.
+    }
     me->internal_dispose();
+    return;
+  }
+  q.disposing = true;
+  me->internal_dispose();
+  while (!q.objects.empty()) {
+    Object* o = q.objects.back();
+    q.objects.pop_back();
+    o->internal_dispose();
+  }
+  q.disposing = false;
+}
+
+namespace {
+
+struct BackgroundReclaimer {
+  std::mutex mutex;
+  std::condition_variable has_work, idle;
+  std::vector<Object*> objects;
+  bool busy = false;
+  bool started = false;
+};
+
+BackgroundReclaimer& get_reclaimer() {
+  static BackgroundReclaimer* r = new BackgroundReclaimer;  // never destroyed
+  return *r;
+}
+
+}  // namespace
+
+/*static*/
+void Object::release_in_background(Object* me) noexcept {
+  if (!me)
+    return;
+  BackgroundReclaimer& r = get_reclaimer();
+  try {
+    std::unique_lock<std::mutex> lock(r.mutex);
+    if (!r.started) {
+      std::thread([&r] {
+        std::unique_lock<std::mutex> lock(r.mutex);
+        for (;;) {
+          r.has_work.wait(lock, [&r] { return !r.objects.empty(); });
+          std::vector<Object*> objects;
+          objects.swap(r.objects);
+          r.busy = true;
+          lock.unlock();
+          for (Object* o : objects)
+            release(o);
+          lock.lock();
+          r.busy = false;
+          if (r.objects.empty())
+            r.idle.notify_all();
+        }
+      }).detach();
+      r.started = true;
+    }
+    r.objects.push_back(me);
+    r.has_work.notify_one();
+    return;
+  } catch (...) {
+    // No thread or no memory, release it here.
+  }
+  release(me);
+}
+
+/* static */
+void Object::release_all(Object** begin, Object** end) noexcept {
+  // Counters of disposed objects are scattered over the heap.
+  const std::ptrdiff_t ahead = 8;
+  for (Object** i = begin; i != end; ++i) {
+#if defined(__GNUC__) || defined(__clang__)
+    if (end - i > ahead && i[ahead])
+      __builtin_prefetch(i[ahead], 1);
+#endif
+    Object* me = *i;
+    *i = nullptr;
+    release(me);
+  }
+}
+
+void wait_for_background_disposal() {
+  BackgroundReclaimer& r = get_reclaimer();
+  std::unique_lock<std::mutex> lock(r.mutex);
+  r.idle.wait(lock, [&r] { return r.objects.empty() && !r.busy; });
+}
+
+namespace {
+
+// Reader of the calling thread.
+struct EpochReader {
+  // Global epoch at the start of the outermost epoch, or zero.
+  std::atomic<std::uint64_t> local{0};
+  int depth = 0;
+  EpochReader* next;
+  EpochReader* prev = nullptr;
+
+  EpochReader();
+  ~EpochReader();
+};
+
+struct EpochRegistry {
+  std::mutex mutex;
+  EpochReader* readers = nullptr;
+  std::atomic<std::uint64_t> global{1};
+  // Hierarchies and the epochs they were retired at.
+  std::vector<std::pair<std::uint64_t, Object*>> retired;
+};
+
+EpochRegistry& epoch_registry() {
+  static EpochRegistry* r = new EpochRegistry;  // never destroyed
+  return *r;
+}
+
+EpochReader::EpochReader() {
+  EpochRegistry& r = epoch_registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  next = r.readers;
+  if (next)
+    next->prev = this;
+  r.readers = this;
+}
+
+EpochReader::~EpochReader() {
+  EpochRegistry& r = epoch_registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  (prev ? prev->next : r.readers) = next;
+  if (next)
+    next->prev = prev;
+}
+
+thread_local EpochReader epoch_reader;
+
+}  // namespace
+
+epoch::epoch() noexcept {
+  EpochReader& r = epoch_reader;
+  if (r.depth++ == 0) {
+    r.local.store(epoch_registry().global.load(std::memory_order_seq_cst),
+                  std::memory_order_seq_cst);
+  }
+}
+
+epoch::~epoch() noexcept {
+  EpochReader& r = epoch_reader;
+  if (--r.depth == 0)
+    r.local.store(0, std::memory_order_release);
+}
+
+/* static */
+void epoch::synchronize() {
+  while (!reclaim())
+    std::this_thread::yield();
+}
+
+/* static */
+bool epoch::reclaim() {
+  EpochRegistry& r = epoch_registry();
+  std::vector<Object*> ready;
+  bool done;
+  {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    // Readers that started at epoch e could see versions retired at e.
+    std::uint64_t oldest = ~std::uint64_t(0);
+    for (EpochReader* i = r.readers; i; i = i->next) {
+      std::uint64_t e = i->local.load(std::memory_order_seq_cst);
+      if (e && e < oldest)
+        oldest = e;
+    }
+    auto visible = std::partition(
+        r.retired.begin(), r.retired.end(),
+        [oldest](const std::pair<std::uint64_t, Object*>& i) {
+          return i.first >= oldest;
+        });
+    for (auto i = visible; i != r.retired.end(); ++i)
+      ready.push_back(i->second);
+    r.retired.erase(visible, r.retired.end());
+    done = r.retired.empty();
+  }
+  for (Object* o : ready)
+    Object::release(o);
+  return done;
+}
+
+/* static */
+void Object::retire(Object* me) {
+  if (!me)
+    return;
+  EpochRegistry& r = epoch_registry();
+  {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.retired.emplace_back(
+        r.global.fetch_add(1, std::memory_order_seq_cst), me);
+  }
+  epoch::reclaim();
+}
+
+struct port_base::State {
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<Object*> domains;
+  bool closed = false;
+};
+
+port_base::port_base() : state(new State) {}
+
+port_base::~port_base() noexcept {
+  for (Object* d : state->domains)
+    Object::release(d);
+  delete state;
+}
+
+void port_base::post(Object*& domain) {
+  assert(Object::is_closed_domain(domain));
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (!state->closed) {
+      state->domains.push_back(domain);
+      domain = nullptr;
+    }
+  }
+  if (domain) {
+    Object::release(domain);
+    domain = nullptr;
+  } else {
+    state->ready.notify_one();
+  }
+}
+
+Object* port_base::receive() {
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->ready.wait(lock,
+                    [this] { return !state->domains.empty() || state->closed; });
+  if (state->domains.empty())
+    return nullptr;
+  Object* r = state->domains.front();
+  state->domains.pop_front();
+  return r;
+}
+
+Object* port_base::try_receive() noexcept {
+  std::lock_guard<std::mutex> lock(state->mutex);
+  if (state->domains.empty())
+    return nullptr;
+  Object* r = state->domains.front();
+  state->domains.pop_front();
+  return r;
+}
+
+void port_base::close() {
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->closed = true;
+  }
+  state->ready.notify_all();
+}
+
+struct thread_pool::State {
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::unique_ptr<task>> tasks;
+  };
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable has_work, idle;
+  // Queued tasks and queued + running tasks.
+  std::size_t queued = 0;
+  std::size_t pending = 0;
+  std::size_t next = 0;
+  bool stopping = false;
+
+  // Own tasks are taken newest first, stolen ones oldest first.
+  std::unique_ptr<task> take(std::size_t me) {
+    std::unique_ptr<task> r;
+    for (std::size_t i = 0; i < workers.size() && !r; i++) {
+      Worker& w = *workers[(me + i) % workers.size()];
+      std::lock_guard<std::mutex> lock(w.mutex);
+      if (w.tasks.empty())
+        continue;
+      if (i == 0) {
+        r = std::move(w.tasks.back());
+        w.tasks.pop_back();
+      } else {
+        r = std::move(w.tasks.front());
+        w.tasks.pop_front();
+      }
+    }
+    return r;
+  }
+
+  void work(std::size_t me);
+};
+
+namespace {
+// State of the pool that runs the current thread.
+thread_local const void* current_pool = nullptr;
+thread_local std::size_t current_worker = 0;
+}  // namespace
+
+void thread_pool::State::work(std::size_t me) {
+  current_pool = this;
+  current_worker = me;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      has_work.wait(lock, [this] { return queued || stopping; });
+      if (!queued)
+        return;
+    }
+    // Other workers can take it first.
+    std::unique_ptr<task> t = take(me);
+    if (!t)
+      continue;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queued--;
+    }
+    t->run();
+    t.reset();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--pending == 0)
+      idle.notify_all();
+  }
+}
+
+thread_pool::thread_pool(std::size_t threads) : state(new State) {
+  if (!threads)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  try {
+    for (std::size_t i = 0; i < threads; i++)
+      state->workers.emplace_back(new State::Worker);
+    for (std::size_t i = 0; i < threads; i++)
+      state->threads.emplace_back([this, i] { state->work(i); });
+  } catch (...) {
+    stop();
+    throw;
+  }
+}
+
+thread_pool::~thread_pool() noexcept {
+  wait();
+  stop();
+}
+
+void thread_pool::stop() noexcept {
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->stopping = true;
+  }
+  state->has_work.notify_all();
+  for (auto& t : state->threads)
+    t.join();
+  delete state;
+}
+
+std::size_t thread_pool::size() const noexcept {
+  return state->workers.size();
+}
+
+void thread_pool::run(std::unique_ptr<task> t) {
+  std::size_t i;
+  {
+    // Counted before it becomes visible to workers, so pending can't drop
+    // to zero while it's queued.
+    std::lock_guard<std::mutex> lock(state->mutex);
+    i = current_pool == state ? current_worker
+                              : state->next++ % state->workers.size();
+    state->queued++;
+    state->pending++;
+  }
+  try {
+    State::Worker& w = *state->workers[i];
+    std::lock_guard<std::mutex> lock(w.mutex);
+    w.tasks.push_back(std::move(t));
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->queued--;
+    if (--state->pending == 0)
+      state->idle.notify_all();
+    throw;
+  }
+  state->has_work.notify_one();
+}
+
+void thread_pool::wait() {
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->idle.wait(lock, [this] { return state->pending == 0; });
+}
+
+/* static */
+void thread_pool::check_domain(Object* root) {
+  assert(Object::is_closed_domain(root));
+  (void)root;
+}
+
+/* static */
+void* Object::operator new(std::size_t size) {
+  if (current_arena) {
+    if (void* r = current_arena->allocate(size))
+      return r;
+  }
+  return ::operator new(size);
+}
+
+/* static */
+void* Object::operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  if (current_arena) {
+    if (void* r = current_arena->allocate(size))
+      return r;
+  }
+  return ::operator new(size, std::nothrow);
+}
+
+/* static */
+void Object::operator delete(void* ptr, std::size_t) noexcept {
+  // Only objects marked by ~Object are looked up in the chunk table.
+  if (deleting_arena_object) {
+    deleting_arena_object = false;
+    if (ArenaChunk* c = ArenaChunk::find(ptr)) {
+      c->unref();
+      return;
+    }
+  }
+  assert(!ArenaChunk::find(ptr));
+  ::operator delete(ptr);
+}
+
+/* static */
+void Object::operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  operator delete(ptr, std::size_t(0));
+}
+
+/* static */
+void Object::compact(Object*& root) {
+  if (!root || (load(root->get_counter()) & SHARED))
+    return;
+  CopyRecord record;
+  Object* copy = nullptr;
+  {
+    Arena arena;
+    CopyRecord* prev_record = current_record;
+    Arena* prev_arena = current_arena;
+    current_record = &record;
+    current_arena = &arena;
+    try {
+      root->finalize_copy(copy);
+    } catch (...) {
+      current_record = prev_record;
+      current_arena = prev_arena;
+      discard_weaks(record, 0);
+      restore_originals(record, 0);
+      throw;
+    }
+    current_record = prev_record;
+    current_arena = prev_arena;
+  }
+  // Weak blocks of originals move to their copies.
+  for (Object* o : record.objects) {
+    WeakBlock* wb = o->find_weak_block();
+    Object* c = untag_ptr<Object>(wb->target);
+    wb->target = c;
+    if (o->has_inline_weak() && c->has_inline_weak()) {
+      static_cast<ObjectWithWeak*>(c)->tombstone = wb;
+      static_cast<ObjectWithWeak*>(o)->tombstone = nullptr;
+    } else {
+      intptr_t org = wb->org_counter;
+      wb->org_counter = (c->counter & ~(WEAKLESS | INLINE_WEAK)) | (org & ATOMIC);
+      c->weak_block = wb;
+      o->counter = org | WEAKLESS;
+    }
+  }
+  // Targets aren't tagged anymore, weaks get their original weak blocks.
+  fix_weaks(record);
+  for (Object* o : record.objects)
+    release(o);
+  Object* prev = root;
+  root = copy;
+  release(prev);
+}
+
+struct arena::State {
+  Arena chunks;
+  Arena* prev;
+#ifndef NDEBUG
+  // Retained weak blocks of roots.
+  std::vector<Object*> roots;
+
+  // Tells if all live objects of the chunks are owned by the roots.
+  bool has_no_escapes() {
+    std::size_t live = 0;
+    for (ArenaChunk* c : chunks.chunks)
+      live += c->live_objects();
+    if (!live)
+      return true;
+    std::vector<Object*> reachable;
+    for (Object* wb : roots) {
+      Object* root = Object::lock(wb);
+      try {
+        Object::collect_reachable(root, reachable);
+      } catch (...) {
+        Object::release(root);
+        throw;
+      }
+      Object::release(root);
+    }
+    std::sort(reachable.begin(), reachable.end());
+    reachable.erase(std::unique(reachable.begin(), reachable.end()),
+                    reachable.end());
+    std::sort(chunks.chunks.begin(), chunks.chunks.end());
+    std::size_t owned = 0;
+    for (Object* o : reachable) {
+      if (std::binary_search(chunks.chunks.begin(), chunks.chunks.end(),
+                             ArenaChunk::find(o)))
+        owned++;
+    }
+    return owned == live;
+  }
+#endif
+};
+
+arena::arena() : state(new State) {
+  state->prev = current_arena;
+  current_arena = &state->chunks;
+}
+
+arena::~arena() noexcept {
+  assert(current_arena == &state->chunks);
+#ifndef NDEBUG
+  // Trial copies of roots go to the heap.
+  current_arena = nullptr;
+  bool no_escapes = true;
+  try {
+    no_escapes = state->has_no_escapes();
+  } catch (...) {
+  }
+  // Objects that outlive the scope must be owned by its roots.
+  assert(no_escapes);
+  (void)no_escapes;
+  for (Object* wb : state->roots)
+    Object::release(wb);
+#endif
+  current_arena = state->prev;
+  delete state;
+}
+
+void arena::keep_root(Object* root) {
+#ifndef NDEBUG
+  state->roots.reserve(state->roots.size() + 1);
+  if (Object* wb = Object::get_weak(root))
+    state->roots.push_back(wb);
+#else
+  (void)root;
+#endif
 }
 
 void Object::internal_dispose() noexcept {
@@ -109,48 +1268,86 @@ void Object::outer_copy_to(Object* src, Object*& dst) {
     dst = nullptr;
     return;
   }
-  intptr_t& counter =
-      src->counter & WEAKLESS ? src->counter : src->weak_block->org_counter;
-  if ((counter & OWNED) == 0) {
-    counter += OWNED + COUNTER_STEP;
+  intptr_t& counter = src->get_counter();
+  intptr_t flags = load(counter);
+  if ((flags & OWNED) == 0) {
+    add_to_counter(counter, OWNED + COUNTER_STEP);
     dst = src;
+    LTM_STAT(ADOPTED);
     return;
   }
-  if (counter & SHARED) {
-    counter += COUNTER_STEP;
+  if (flags & SHARED) {
+#ifndef NDEBUG
+    if (domain_check)
+      domain_check->shared.push_back(src);
+#endif
+    add_to_counter(counter, COUNTER_STEP);
     dst = src;
+    LTM_STAT(SHARED_RETAINED);
     return;
   }
+  LTM_STAT(COPIED);
   src->finalize_copy(dst);
 }
 
+/* static */
+void Object::inplace_copy_to(Object* src, Object*& dst) {
+  if (defer_copies && src &&
+      (load(src->get_counter()) & (OWNED | SHARED)) == OWNED) {
+    deferred_copies.push_back(&dst);
+    dst = retain(src);
+  } else {
+    outer_copy_to(src, dst);
+  }
+}
+
+Object::deferred_copy_scope::deferred_copy_scope() noexcept
+    : prev(defer_copies) {
+  defer_copies = true;
+}
+
+Object::deferred_copy_scope::~deferred_copy_scope() noexcept {
+  defer_copies = prev;
+}
+
 /* static */
 void Object::force_copy_to(Object* src, Object*& dst) {
   if (!src)
     dst = nullptr;
   else {
     src->finalize_copy(dst);
-    (dst->counter & WEAKLESS ? dst->counter : dst->weak_block->org_counter) &=
-        ~SHARED;
+    dst->get_counter() &= ~SHARED;
   }
 }
 
 Object::copy_transaction::copy_transaction() {
-  copy_depth++;
+  if (copy_depth++ == 0) {
+    LTM_STAT_TRANSACTION_START();
+  }
 }
 
 Object::copy_transaction::~copy_transaction() {
   if (--copy_depth == 0) {
     Object* c = nullptr;
+    bool c_inline = false;
     WeakBlock* wb = nullptr;
+    // The copy doesn't need a weak block, clear its list link.
+    auto reset = [&] {
+      if (c_inline)
+        c->weak_block_slot(true) = nullptr;
+      else
+        c->counter = Object::COUNTER_STEP | Object::OWNED | Object::WEAKLESS |
+                     c->arena_flag();
+    };
     for (Object* i = copy_head; i;) {
       switch (get_ptr_tag(i)) {
         case Tag::OBJECT:
+        case Tag::INLINE_OBJECT:
           if (c)
-            c->counter =
-                Object::COUNTER_STEP | Object::OWNED | Object::WEAKLESS;
+            reset();
+          c_inline = get_ptr_tag(i) == Tag::INLINE_OBJECT;
           c = untag_ptr<Object>(i);
-          i = c->weak_block;
+          i = c->weak_block_slot(c_inline);
           break;
         case Tag::WEAK_BLOCK:
           wb = untag_ptr<WeakBlock>(i);
@@ -162,38 +1359,495 @@ Object::copy_transaction::~copy_transaction() {
           WeakBlock** w = untag_ptr<WeakBlock*>(i);
           i = *w;
           *w = wb;
-          wb->counter += Object::COUNTER_STEP;
+          add_to_counter(wb->counter, Object::COUNTER_STEP);
         } break;
       }
     }
     if (c)
-      c->counter = Object::COUNTER_STEP | Object::OWNED | Object::WEAKLESS;
+      reset();
     copy_head = nullptr;
+    LTM_STAT_TRANSACTION_END();
   }
 }
 
+void Object::call_copy_to(Object*& dst) {
+  // Only copy constructors called directly from LTM_ITERATIVE_COPYABLE
+  // postpone copies.
+  bool defer = defer_copies;
+  defer_copies = false;
+  struct restore_defer {
+    bool defer;
+    ~restore_defer() { defer_copies = defer; }
+  } restore{defer};
+  copy_to(dst);
+}
+
 void Object::finalize_copy(Object*& dst) {
+  if (current_record) {
+#ifndef NDEBUG
+    if (domain_check && !is_weak_block()) {
+      domain_check->copied.push_back(this);
+      intptr_t owners = this == deferred_source ? 2 : 1;
+      if ((load(get_counter()) & ~(COUNTER_STEP - 1)) != owners * COUNTER_STEP)
+        domain_check->pinned = true;
+    }
+    deferred_source = nullptr;
+#endif
+    LTM_STAT_FINALIZED(1);
+    call_copy_to(dst);
+    if (WeakBlock* wb = find_weak_block()) {
+      current_record->objects.push_back(this);
+      retain(this);
+      as_atomic(wb->target)
+          .store(tag_ptr<Object>(dst, Tag::OBJECT), std::memory_order_relaxed);
+    }
+    if (!draining_copies && !deferred_copies.empty())
+      drain_deferred_copies();
+    return;
+  }
   copy_transaction transaction;
-  copy_to(dst);
-  if ((counter & WEAKLESS) == 0)  // has weak block
-  {
-    if (weak_block->target == this)  // no weak copied yet
+  LTM_STAT_FINALIZED(1);
+  call_copy_to(dst);
+  if (WeakBlock* wb = find_weak_block()) {
+    bool is_inline = has_inline_weak();
+    Tag tag = is_inline ? Tag::INLINE_OBJECT : Tag::OBJECT;
+    WeakBlock*& dst_wb = dst->weak_block_slot(is_inline);
+    if (wb->target == this)  // no weak copied yet
     {
-      weak_block->target = tag_ptr<WeakBlock>(dst, Tag::OBJECT);
-      dst->weak_block = static_cast<WeakBlock*>(copy_head);
-      copy_head = tag_ptr<Object>(this, Tag::OBJECT);
+      wb->target = tag_ptr<WeakBlock>(dst, tag);
+      dst_wb = static_cast<WeakBlock*>(copy_head);
+      copy_head = tag_ptr<Object>(this, tag);
+    } else {
+      dst_wb = new WeakBlock(
+          dst, is_inline ? 0 : COUNTER_STEP | OWNED | dst->arena_flag());
+      while (get_ptr_tag(wb->target) == Tag::WEAK) {
+        WeakBlock*& w = *untag_ptr<WeakBlock*>(wb->target);
+        wb->target = w;
+        w = dst_wb;
+        retain(dst_wb);
+      }
+      dst_wb->target = wb->target;
+      wb->target = tag_ptr<WeakBlock>(dst, tag);
+    }
+  }
+  if (!draining_copies && !deferred_copies.empty())
+    drain_deferred_copies();
+}
+
+/* static */
+void Object::copy_deferred(Object*& slot) {
+  Object* src = slot;
+#ifndef NDEBUG
+  deferred_source = src;
+#endif
+  try {
+    src->finalize_copy(slot);
+  } catch (...) {
+    slot = nullptr;
+    release(src);
+    throw;
+  }
+  release(src);
+}
+
+/* static */
+void Object::discard_deferred(Object*** begin, Object*** end) noexcept {
+  for (; begin != end; ++begin) {
+    release(**begin);
+    **begin = nullptr;
+  }
+}
+
+/* static */
+void Object::drain_deferred_copies() {
+  draining_copies = true;
+  try {
+    while (!deferred_copies.empty()) {
+      Object** slot = deferred_copies.back();
+      deferred_copies.pop_back();
+      copy_deferred(*slot);
+    }
+  } catch (...) {
+    // Slots of postponed copies still hold (retained) sources.
+    discard_deferred(deferred_copies.data(),
+                     deferred_copies.data() + deferred_copies.size());
+    deferred_copies.clear();
+    draining_copies = false;
+    throw;
+  }
+  draining_copies = false;
+}
+
+namespace {
+
+struct RecordingScope {
+  explicit RecordingScope(CopyRecord& record) {
+    current_record = &record;
+    force_atomic = true;
+  }
+  ~RecordingScope() {
+    current_record = nullptr;
+    force_atomic = false;
+  }
+};
+
+}  // namespace
+
+/* static */
+Object* Object::parallel_copy(Object* src, std::size_t threads) {
+  Object* dst = nullptr;
+  if (threads < 2 || !src ||
+      (load(src->get_counter()) & (OWNED | SHARED)) != OWNED) {
+    outer_copy_to(src, dst);
+    return dst;
+  }
+  std::vector<CopyRecord> records(threads);
+  std::vector<Object**> items;
+  std::atomic<std::size_t> next_item{0};
+  std::atomic<bool> failed{false};
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  auto discard_records = [&] {
+    for (auto& r : records) {
+      discard_weaks(r, 0);
+      restore_originals(r, 0);
+    }
+  };
+
+  // Copy the top levels breadth-first on this thread, until there are
+  // enough subtrees for all threads.
+  try {
+    RecordingScope recording(records[0]);
+    draining_copies = true;  // keep postponed copies for the threads
+    src->finalize_copy(dst);
+    while (!deferred_copies.empty() && deferred_copies.size() < threads * 8) {
+      std::vector<Object**> level;
+      level.swap(deferred_copies);
+      for (std::size_t i = 0; i < level.size(); i++) {
+        try {
+          copy_deferred(*level[i]);
+        } catch (...) {
+          discard_deferred(level.data() + i + 1, level.data() + level.size());
+          throw;
+        }
+      }
+    }
+    items.swap(deferred_copies);
+    draining_copies = false;
+  } catch (...) {
+    draining_copies = false;
+    discard_deferred(deferred_copies.data(),
+                     deferred_copies.data() + deferred_copies.size());
+    deferred_copies.clear();
+    discard_records();
+    release(dst);
+    throw;
+  }
+
+  // Copy subtrees, each thread has its own record.
+  auto work = [&](CopyRecord& record) {
+    RecordingScope recording(record);
+    for (std::size_t i; !failed && (i = next_item++) < items.size();) {
+      try {
+        copy_deferred(*items[i]);
+      } catch (...) {
+        failed = true;
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (std::size_t i = 1; i < threads && items.size() > 1; i++) {
+    try {
+      workers.emplace_back(work, std::ref(records[i]));
+    } catch (...) {
+      break;  // continue with the threads that are already started
+    }
+  }
+  work(records[0]);
+  for (auto& t : workers)
+    t.join();
+  if (failed) {
+    std::size_t taken = std::min<std::size_t>(next_item, items.size());
+    discard_deferred(items.data() + taken, items.data() + items.size());
+    discard_records();
+    release(dst);
+    std::rethrow_exception(error);
+  }
+
+  // Merge: weaks to copied objects get redirected to their copies, other
+  // weaks keep pointing to their original targets.
+  try {
+    for (auto& r : records)
+      fix_weaks(r);
+  } catch (...) {
+    discard_records();
+    release(dst);
+    throw;
+  }
+  for (auto& r : records)
+    restore_originals(r, 0);
+  return dst;
+}
+
+/* static */
+void Object::fix_weaks(CopyRecord& record) {
+  for (auto& weaks = record.weaks; !weaks.empty(); weaks.pop_back()) {
+    auto& i = weaks.back();
+    Object* target = i.second->target;
+    if (get_ptr_tag(target) == Tag::OBJECT) {
+      *i.first = get_weak(untag_ptr<Object>(target));
+      release(i.second);
     } else {
-      dst->weak_block = new WeakBlock(dst, COUNTER_STEP | OWNED);
-      while (get_ptr_tag(weak_block->target) == Tag::WEAK) {
-        WeakBlock*& w = *untag_ptr<WeakBlock*>(weak_block->target);
-        weak_block->target = w;
-        w = dst->weak_block;
-        retain(dst->weak_block);
+      *i.first = i.second;
+    }
+  }
+}
+
+/* static */
+void Object::discard_weaks(CopyRecord& record, std::size_t from) noexcept {
+  auto& weaks = record.weaks;
+  for (std::size_t i = from; i < weaks.size(); i++)
+    release(weaks[i].second);
+  weaks.resize(from);
+}
+
+/* static */
+void Object::restore_originals(CopyRecord& record,
+                               std::size_t from) noexcept {
+  auto& objects = record.objects;
+  for (std::size_t i = from; i < objects.size(); i++) {
+    objects[i]->find_weak_block()->target = objects[i];
+    release(objects[i]);
+  }
+  objects.resize(from);
+}
+
+/* static */
+bool Object::is_closed_domain(Object* root) {
+  if (!root)
+    return true;
+  intptr_t c = load(root->get_counter());
+  if ((c & (OWNED | SHARED)) != OWNED ||
+      (c & ~(COUNTER_STEP - 1)) != COUNTER_STEP)
+    return false;
+#ifdef NDEBUG
+  return true;
+#else
+  auto refs = [](intptr_t& counter) {
+    return load(counter) / COUNTER_STEP;
+  };
+  CopyRecord record;
+  DomainCheck check;
+  Object* copy = trial_copy(root, record, check);
+  bool closed = !check.pinned;
+  // Each weak is counted by the weak field and by the record. Weak blocks
+  // of live objects are also held by their objects.
+  std::vector<WeakBlock*> weaks;
+  for (auto& i : record.weaks)
+    weaks.push_back(i.second);
+  std::sort(weaks.begin(), weaks.end());
+  for (auto i = weaks.begin(); i != weaks.end();) {
+    auto next = std::upper_bound(i, weaks.end(), *i);
+    WeakBlock* wb = *i;
+    intptr_t n = next - i;
+    if (wb->target && get_ptr_tag(wb->target) != Tag::OBJECT)
+      closed = false;  // points outside
+    else if (!wb->target && refs(wb->counter) != 2 * n)
+      closed = false;
+    i = next;
+  }
+  for (Object* o : record.objects) {
+    WeakBlock* wb = o->find_weak_block();
+    auto range = std::equal_range(weaks.begin(), weaks.end(), wb);
+    if (refs(wb->counter) != 2 * (range.second - range.first) + 1)
+      closed = false;
+  }
+  // Shared objects got retained once more per reference by the copy.
+  std::sort(check.shared.begin(), check.shared.end());
+  for (auto i = check.shared.begin(); i != check.shared.end();) {
+    auto next = std::upper_bound(i, check.shared.end(), *i);
+    if (refs((*i)->get_counter()) != 2 * (next - i))
+      closed = false;
+    i = next;
+  }
+  discard_weaks(record, 0);
+  restore_originals(record, 0);
+  release(copy);
+  return closed;
+#endif
+}
+
+#ifndef NDEBUG
+/* static */
+void Object::collect_reachable(Object* root, std::vector<Object*>& dst) {
+  if (!root)
+    return;
+  CopyRecord record;
+  DomainCheck check;
+  Object* copy = trial_copy(root, record, check);
+  discard_weaks(record, 0);
+  restore_originals(record, 0);
+  release(copy);
+  dst.insert(dst.end(), check.copied.begin(), check.copied.end());
+  dst.insert(dst.end(), check.shared.begin(), check.shared.end());
+}
+
+/* static */
+Object* Object::trial_copy(Object* root,
+                           CopyRecord& record,
+                           DomainCheck& check) {
+  CopyRecord* prev_record = current_record;
+  DomainCheck* prev_check = domain_check;
+  current_record = &record;
+  domain_check = &check;
+  Object* copy = nullptr;
+  try {
+    root->finalize_copy(copy);
+  } catch (...) {
+    current_record = prev_record;
+    domain_check = prev_check;
+    discard_weaks(record, 0);
+    restore_originals(record, 0);
+    throw;
+  }
+  current_record = prev_record;
+  domain_check = prev_check;
+  return copy;
+}
+#endif
+
+namespace {
+thread_local CopyRecord edit_record;
+}  // namespace
+
+// Nested edits and edits inside of parallel_copy join the outer record.
+cow_edit::cow_edit() : active(!current_record) {
+  if (active)
+    current_record = &edit_record;
+}
+
+cow_edit::~cow_edit() {
+  if (active) {
+    current_record = nullptr;
+    try {
+      Object::fix_weaks(edit_record);
+    } catch (...) {
+      // Out of memory, the rest of weaks stay null.
+      Object::discard_weaks(edit_record, 0);
+    }
+    Object::restore_originals(edit_record, 0);
+  }
+}
+
+/* static */
+void Object::assign_copy_to(Object* src, Object*& dst) {
+  if (assigning && src && dst && src != dst &&
+      assign_depth < MAX_ASSIGN_DEPTH &&
+      (load(src->get_counter()) & (OWNED | SHARED)) == OWNED &&
+      (load(dst->get_counter()) & (OWNED | SHARED)) == OWNED) {
+    struct nest {
+      nest() noexcept { assign_depth++; }
+      ~nest() { assign_depth--; }
+    };
+    bool reused;
+    {
+      nest level;
+      reused = src->assign_to(dst);
+    }
+    if (reused) {
+      // Weaks to src get mapped to dst, as if it was a copy.
+      if (WeakBlock* wb = src->find_weak_block()) {
+        current_record->objects.push_back(src);
+        retain(src);
+        wb->target = tag_ptr<Object>(dst, Tag::OBJECT);
       }
-      dst->weak_block->target = weak_block->target;
-      weak_block->target = tag_ptr<WeakBlock>(dst, Tag::OBJECT);
+      return;
     }
   }
+  Object* temp;
+  outer_copy_to(src, temp);
+  release(dst);
+  dst = temp;
+}
+
+/* static */
+void Object::assign_weak(Object* src, Object*& dst) noexcept {
+  Object* prev = dst;
+  // Proxies are their own weaks.
+  if (assigning && src && src->is_weak_block()) {
+    dst = nullptr;
+    current_record->weaks.emplace_back(&dst, static_cast<WeakBlock*>(src));
+    retain(src);
+  } else {
+    dst = get_weak(src);
+  }
+  release(prev);
+}
+
+/* static */
+void Object::assign_into(Object* src, Object*& dst) {
+  if (src == dst)
+    return;
+  cow_edit edit;
+  struct restore_assigning {
+    bool prev;
+    ~restore_assigning() { assigning = prev; }
+  } restore{assigning};
+  assigning = true;
+  CopyRecord& record = *current_record;
+  std::size_t objects = record.objects.size();
+  std::size_t weaks = record.weaks.size();
+  try {
+    assign_copy_to(src, dst);
+  } catch (...) {
+    discard_weaks(record, weaks);
+    restore_originals(record, objects);
+    throw;
+  }
+}
+
+/* static */
+void Object::unshare(Object*& target) {
+  if (!target || load(target->get_counter()) < 2 * COUNTER_STEP)
+    return;
+  cow_edit edit;
+  CopyRecord& record = *current_record;
+  std::size_t objects = record.objects.size();
+  std::size_t weaks = record.weaks.size();
+  Object* copy;
+  try {
+    target->finalize_copy(copy);
+  } catch (...) {
+    discard_weaks(record, weaks);
+    restore_originals(record, objects);
+    throw;
+  }
+  release(target);
+  target = copy;
+}
+
+WeakBlock* Object::find_weak_block() noexcept {
+  intptr_t c = load(counter);
+  return (c & WEAKLESS) == 0 ? weak_block
+         : c & INLINE_WEAK   ? static_cast<ObjectWithWeak*>(this)->tombstone
+                             : nullptr;
+}
+
+intptr_t Object::arena_flag() noexcept {
+  return current_arena && ArenaChunk::find(this) ? IN_ARENA : 0;
+}
+
+bool Object::is_weak_block() noexcept {
+  return (load(counter) & (WEAKLESS | IS_WEAK_BLOCK)) ==
+         (WEAKLESS | IS_WEAK_BLOCK);
+}
+
+WeakBlock*& Object::weak_block_slot(bool is_inline) noexcept {
+  return is_inline ? static_cast<ObjectWithWeak*>(this)->tombstone
+                   : weak_block;
 }
 
 Object* Object::get_weak() {
@@ -207,36 +1861,93 @@ Object* Object::get_target() noexcept {
   return this;
 }
 
+bool Object::assign_to(Object*) {
+  return false;
+}
+
 void Object::make_shared() noexcept {
-  (counter & WEAKLESS ? counter : weak_block->org_counter) |= SHARED;
+  get_counter() |= SHARED;
+}
+
+void Object::make_atomic() {
+  if (counter & WEAKLESS) {
+    // ObjectWithWeak switches to the regular layout reusing its tombstone.
+    intptr_t flags = counter & ~(WEAKLESS | INLINE_WEAK);
+    WeakBlock* wb = nullptr;
+    if (has_inline_weak())
+      std::swap(wb, static_cast<ObjectWithWeak*>(this)->tombstone);
+    if (wb)
+      wb->org_counter = flags;
+    else
+      wb = new WeakBlock(this, flags);
+    weak_block = wb;
+  }
+  weak_block->org_counter |= ATOMIC;
+  weak_block->counter |= ATOMIC;
+}
+
+/* static */
+void* WeakBlock::operator new(std::size_t size) {
+  LTM_STAT(WEAK_BLOCKS_ALLOCATED);
+  if (size != WeakBlockPool::BLOCK_SIZE || WeakBlockPool::gone)
+    return ::operator new(size);
+  return weak_block_pool.allocate();
+}
+
+/* static */
+void WeakBlock::operator delete(void* ptr, std::size_t size) noexcept {
+  LTM_STAT(WEAK_BLOCKS_FREED);
+  if (size != WeakBlockPool::BLOCK_SIZE)
+    ::operator delete(ptr);
+  else if (WeakBlockPool::gone) {  // freed at thread exit
+    FreeBlock* b = static_cast<FreeBlock*>(ptr);
+    b->next = nullptr;
+    WeakBlockPool::give_away(b, 1);
+  } else
+    weak_block_pool.free(ptr);
+}
+
+WeakBlockPoolStats get_weak_block_pool_stats() noexcept {
+  return weak_block_pool.stats;
 }
 
 WeakBlock::WeakBlock(Object* target, intptr_t org_counter) noexcept
     : target(target), org_counter(org_counter) {
-  counter = OWNED | COUNTER_STEP |
-            WEAKLESS;  // not shared to force the copy_to invocation
+  counter = OWNED | COUNTER_STEP | WEAKLESS |
+            IS_WEAK_BLOCK;  // not shared to force the copy_to invocation
 }
 
 Object* WeakBlock::get_weak() {
-  counter += COUNTER_STEP;
-  return this;
+  return retain(this);
 }
 
 Object* WeakBlock::get_target() noexcept {
-  return target;
+  return load(target);
 }
 
 void WeakBlock::copy_to(Object*& dst) {
-  if (!target)
+  LTM_STAT(WEAKS_COPIED);
+  LTM_STAT_FINALIZED(-1);
+  if (!load(target)) {
     dst = nullptr;
-  else if (copy_depth == 1 && org_counter & SHARED) {
+  } else if (current_record) {  // resolved after the parallel copy
+    dst = nullptr;
+    current_record->weaks.emplace_back(&dst, this);
+    retain(this);
+  }
+  // Weaks to shared objects are retained instead of being copied.
+  // Atomic ones are never marked with copy tags, because other threads
+  // can access their weak blocks concurrently.
+  else if (load(org_counter) & SHARED &&
+           (copy_depth == 1 || load(org_counter) & ATOMIC)) {
     retain(this);
     dst = this;
   } else {
     switch (get_ptr_tag(target)) {
       case Tag::WEAK_BLOCK:  // tagWB == 0, so it is an uncopied object
         dst = copy_head;
-        copy_head = tag_ptr<Object>(target, Tag::OBJECT);
+        copy_head = tag_ptr<Object>(
+            target, target->has_inline_weak() ? Tag::INLINE_OBJECT : Tag::OBJECT);
         target = tag_ptr<Object>(&dst, Tag::WEAK);
         break;
       case Tag::WEAK:  // already accessed by weak in this copy
@@ -244,32 +1955,63 @@ void WeakBlock::copy_to(Object*& dst) {
         target = tag_ptr<Object>(&dst, Tag::WEAK);
         break;
       case Tag::OBJECT:  // already copied
-      {
+      case Tag::INLINE_OBJECT: {
+        bool is_inline = get_ptr_tag(target) == Tag::INLINE_OBJECT;
         Object* copy = untag_ptr<Object>(target);
-        WeakBlock* cwb = copy->weak_block;
-        if (!cwb || get_ptr_tag(cwb) == Tag::OBJECT)  // has no wb yet
+        WeakBlock*& slot = copy->weak_block_slot(is_inline);
+        WeakBlock* cwb = slot;
+        if (!cwb || get_ptr_tag(cwb) != Tag::WEAK_BLOCK)  // has no wb yet
         {
-          cwb = new WeakBlock(cwb, COUNTER_STEP | OWNED);
-          copy->weak_block = tag_ptr<WeakBlock>(cwb, Tag::WEAK_BLOCK);
-        } else
-          cwb = untag_ptr<WeakBlock>(cwb);
+          cwb = new WeakBlock(
+              cwb, is_inline ? 0 : COUNTER_STEP | OWNED | copy->arena_flag());
+          slot = tag_ptr<WeakBlock>(cwb, Tag::WEAK_BLOCK);
+        }
         dst = Object::retain(cwb);
       } break;
     }
   }
 }
 
+ObjectWithWeak::ObjectWithWeak() noexcept {
+  counter |= INLINE_WEAK;
+}
+
+ObjectWithWeak::ObjectWithWeak(const ObjectWithWeak& src) noexcept
+    : Object(src) {
+  counter |= INLINE_WEAK;
+}
+
+ObjectWithWeak::~ObjectWithWeak() noexcept {
+  if (tombstone) {
+    tombstone->target = nullptr;
+    release(tombstone);
+  }
+}
+
+Object* ObjectWithWeak::get_weak() {
+  if (!has_inline_weak())  // made atomic
+    return Object::get_weak();
+  if (!tombstone)
+    tombstone = new WeakBlock(this, 0);
+  return retain(tombstone);
+}
+
 #ifdef TESTS
 /* static */
 void Object::check(const Object* c, uintptr_t flags, uintptr_t weak_flags = 0) {
   if (!c) {
     assert(flags == 0 && weak_flags == 0);
   } else if (c->counter & Object::WEAKLESS) {
-    assert(c->counter == flags);
-    assert(weak_flags == 0);
+    assert((c->counter & ~IN_ARENA) == flags);
+    auto tombstone = c->has_inline_weak()
+                         ? static_cast<const ObjectWithWeak*>(c)->tombstone
+                         : nullptr;
+    assert(tombstone ? tombstone->counter == (weak_flags | IS_WEAK_BLOCK)
+                     : weak_flags == 0);
+    assert(!tombstone || tombstone->target == c);
   } else {
-    assert(c->weak_block->org_counter == flags);
-    assert(c->weak_block->counter == weak_flags);
+    assert((c->weak_block->org_counter & ~IN_ARENA) == flags);
+    assert(c->weak_block->counter == (weak_flags | IS_WEAK_BLOCK));
     assert(c->weak_block->target == c);
   }
 }
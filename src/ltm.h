@@ -17,13 +17,24 @@ limitations under the License.
 #ifndef _LTM_H_
 #define _LTM_H_
 
+#include <atomic>
 #include <cstdint>
 #include <cstdlib>
+#include <functional>
+#include <typeinfo>
+#include <type_traits>
+#include <iterator>
+#include <memory>
+#include <new>
 #include <utility>
+#include <vector>
 
 namespace ltm {
 class Object;
 class WeakBlock;
+class ObjectWithWeak;
+struct CopyRecord;
+struct DomainCheck;
 
 template <typename T>
 class own;
@@ -35,9 +46,36 @@ template <typename T>
 class iweak;
 template <typename T>
 class ipin;
+template <typename T>
+class cow;
+class cow_edit;
+template <typename T>
+class borrow;
+template <typename T>
+class own_vector;
+template <typename K, typename V>
+class weak_map;
+class port_base;
+class thread_pool;
+class epoch;
+template <typename T>
+class rcu;
+class arena;
+template <typename SIGNATURE>
+class delegate;
+template <typename... ARGS>
+class signal;
+
+template <typename T>
+void dispose_in_background(own<T>&& root) noexcept;
+template <typename T>
+own<T> parallel_copy(const own<T>& src, std::size_t threads);
+template <typename T>
+void compact(own<T>& root);
 
 class Object {
   friend class WeakBlock;
+  friend class ObjectWithWeak;
   template <typename BASE>
   friend class Proxy;
   template <typename T>
@@ -50,8 +88,40 @@ class Object {
   friend class iweak;
   template <typename T>
   friend class ipin;
+  template <typename T>
+  friend class cow;
+  friend class cow_edit;
+  template <typename T>
+  friend class borrow;
+  template <typename T>
+  friend class own_vector;
+  template <typename K, typename V>
+  friend class weak_map;
+  friend class port_base;
+  friend class thread_pool;
+  friend class epoch;
+  template <typename T>
+  friend class rcu;
+  friend class arena;
+  template <typename T>
+  friend void dispose_in_background(own<T>&& root) noexcept;
+  template <typename T>
+  friend own<T> parallel_copy(const own<T>& src, std::size_t threads);
+  template <typename T>
+  friend void compact(own<T>& root);
 
  public:
+  // Objects created inside of arena scopes and copies made by compact()
+  // are allocated in arena chunks.
+  static void* operator new(std::size_t size);
+  static void* operator new(std::size_t size, const std::nothrow_t&) noexcept;
+  static void* operator new(std::size_t, void* place) noexcept {
+    return place;
+  }
+  static void operator delete(void* ptr, std::size_t size) noexcept;
+  static void operator delete(void* ptr, const std::nothrow_t&) noexcept;
+  static void operator delete(void*, void*) noexcept {}
+
   template <typename FROM, typename TO>
   static void copy(FROM begin, FROM end, TO dst) {
     copy_transaction transaction;
@@ -59,14 +129,20 @@ class Object {
       *dst++ = *begin++;
   }
 
+  // Copies container[begin, end) to a temporary in one transaction and
+  // moves the copies into place with a single insert.
   template <typename VECTOR>
   static void copy(VECTOR& container,
                    std::size_t begin,
                    std::size_t end,
                    std::size_t dst) {
-    copy_transaction transaction;
-    while (begin != end)
-      container.insert(container.begin() + dst++, container[begin++]);
+    VECTOR copies;
+    copies.reserve(end - begin);
+    copy(container.begin() + begin, container.begin() + end,
+         std::back_inserter(copies));
+    container.insert(container.begin() + dst,
+                     std::make_move_iterator(copies.begin()),
+                     std::make_move_iterator(copies.end()));
   }
 
  protected:
@@ -84,9 +160,30 @@ class Object {
   // WeakBlock and Proxy objects can override it
   virtual Object* get_target() noexcept;
 
+  // Implemented in LTM_ASSIGNABLE objects, copy-assigns this object into
+  // dst if it has the same dynamic type, otherwise returns false.
+  virtual bool assign_to(Object* dst);
+
   // Used by application code to make owning ptrs act as pins.
   void make_shared() noexcept;
 
+  // Used by application code to make all counters of this object
+  // (pin, shared and weak) thread-safe. Should be called before the object
+  // becomes visible to other threads, usually in constructor after
+  // make_shared(). Atomic objects always have a weak block.
+  // Copying of non-shared atomic objects is not thread-safe.
+  void make_atomic();
+
+  // Used by LTM_ITERATIVE_COPYABLE. While it exists, copy constructors of
+  // own<T> don't copy their targets immediately, but put them to a
+  // thread-local work stack, that is processed in a loop after the outermost
+  // copy_to returns.
+  struct deferred_copy_scope {
+    deferred_copy_scope() noexcept;
+    ~deferred_copy_scope() noexcept;
+    bool prev;
+  };
+
 #ifdef TESTS
  public:
   static void check(const Object* c, uintptr_t flags, uintptr_t weak_flags);
@@ -109,9 +206,20 @@ class Object {
     // If its weak block contains additional atomic counters.
     ATOMIC = intptr_t(8),
 
+    // Along with WEAKLESS - it's ObjectWithWeak that keeps its counter in
+    // place, and its weak block, if any, is ObjectWithWeak::tombstone.
+    INLINE_WEAK = intptr_t(16),
+
+    // Along with WEAKLESS - it's WeakBlock, so weak pointers can get
+    // its target without a virtual call.
+    IS_WEAK_BLOCK = intptr_t(32),
+
+    // Allocated in an arena chunk, so operator delete looks the chunk up.
+    IN_ARENA = intptr_t(64),
+
     // Number of owning ptrs (if shared) + pin-ptrs pointing here,
     // if 0 - deleted
-    COUNTER_STEP = intptr_t(16),
+    COUNTER_STEP = intptr_t(128),
   };
 
  private:
@@ -120,21 +228,102 @@ class Object {
     WeakBlock* weak_block;
   };
 
+  // Returns the real counter, either the in-place one or the one
+  // located in weak_block->org_counter.
+  intptr_t& get_counter() noexcept;
+
+  bool has_inline_weak() const noexcept {
+    return (counter & (WEAKLESS | INLINE_WEAK)) == (WEAKLESS | INLINE_WEAK);
+  }
+
+  // Returns the weak block or tombstone or null if there is no weak block.
+  WeakBlock* find_weak_block() noexcept;
+
+  // Tells WeakBlocks from proxies without a virtual call.
+  bool is_weak_block() noexcept;
+
+  // IN_ARENA if allocated by the current arena. Called on construction,
+  // and for copies whose counters were replaced by copy links.
+  intptr_t arena_flag() noexcept;
+
+  // Returns the field that holds the weak block or the tombstone.
+  WeakBlock*& weak_block_slot(bool is_inline) noexcept;
+
+  // Counter modifications that respect the ATOMIC flag.
+  static void add_to_counter(intptr_t& counter, intptr_t delta) noexcept;
+  static intptr_t sub_from_counter(intptr_t& counter, intptr_t delta) noexcept;
+
   // Used by owning poiners.
   static void outer_copy_to(Object* src, Object*& dst);
+  // Used by copy constructors of owning pointers, it can postpone the copy.
+  static void inplace_copy_to(Object* src, Object*& dst);
   static void force_copy_to(Object* src, Object*& dst);
+  // Used by assignments of owning and weak pointers. Inside of assign_into
+  // they reuse existing destination objects and record weaks.
+  static void assign_copy_to(Object* src, Object*& dst);
+  static void assign_weak(Object* src, Object*& dst) noexcept;
+  static void assign_into(Object* src, Object*& dst);
   void finalize_copy(Object*& dst);
+  void call_copy_to(Object*& dst);
+  static void copy_deferred(Object*& slot);
+  static void discard_deferred(Object*** begin, Object*** end) noexcept;
+  static void drain_deferred_copies();
+  static Object* parallel_copy(Object* src, std::size_t threads);
+  static void compact(Object*& root);
+  // Points recorded weaks to copies of their targets if any, or to their
+  // original targets.
+  static void fix_weaks(CopyRecord& record);
+  // Forget weaks and originals recorded from the given positions.
+  static void discard_weaks(CopyRecord& record, std::size_t from) noexcept;
+  static void restore_originals(CopyRecord& record, std::size_t from) noexcept;
+
+  // Used by copy-on-write pointers, replaces a target that is not owned
+  // exclusively with its copy.
+  static void unshare(Object*& target);
 
   // Used by weak pointers
   static Object* get_weak(Object* me);
   static Object* get_target(Object* me) noexcept;
 
+  // Used by weak pointers to make pins, returns retained target or null.
+  // Unlike retain(get_target()) it doesn't revive an atomic object that is
+  // being disposed on another thread.
+  static Object* lock(Object* me) noexcept;
+
   // Used by pin-ptrs
   static Object* retain(Object* me) noexcept;
 
   // Used by all ptrs: owning, weak and pin.
   static void release(Object* me) noexcept;
 
+  // Disposes an object whose counter dropped to zero. Objects released
+  // while another object is being disposed on this thread are queued
+  // and disposed in a loop, so destruction of deep hierarchies doesn't
+  // consume stack.
+  static void dispose(Object* me) noexcept;
+
+  // Passes the reference to the background reclamation thread.
+  static void release_in_background(Object* me) noexcept;
+
+  // Releases and nulls a range of pointers, prefetching objects ahead.
+  static void release_all(Object** begin, Object** end) noexcept;
+
+  // Disposes the hierarchy once all epochs that could see it end.
+  static void retire(Object* me);
+
+  // Tells if nothing outside of the hierarchy holds pins or weaks to its
+  // objects or to shared objects it refers to, and its weaks don't point
+  // outside. Makes a trial copy, used by debug checks of ports.
+  static bool is_closed_domain(Object* root);
+  // Collects objects owned by the hierarchy, and shared objects it refers
+  // to. Makes a trial copy, used by debug checks of arenas.
+  static void collect_reachable(Object* root, std::vector<Object*>& dst);
+  // Copies the hierarchy in recording mode, filling the check. The caller
+  // discards the record and releases the copy.
+  static Object* trial_copy(Object* root,
+                            CopyRecord& record,
+                            DomainCheck& check);
+
   void operator=(const Object&) = delete;
 
   struct copy_transaction {
@@ -149,15 +338,23 @@ class Proxy : public BASE {
   void copy_to(Object*&) override {
     abort();  // call make_shared or implement copy_to
   }
-  Object* get_weak() override {
-    this->counter += Object::COUNTER_STEP;
-    return this;
-  }
+  Object* get_weak() override { return Object::retain(this); }
   Object* get_target() noexcept override { return this; }
 };
 
+// Base of LTM_ASSIGNABLE classes. Its assignment doesn't touch counters,
+// so derived classes can use implicit copy assignment operators.
+template <typename BASE = Object>
+class Assignable : public BASE {
+ protected:
+  Assignable() = default;
+  Assignable(const Assignable&) = default;
+  Assignable& operator=(const Assignable&) noexcept { return *this; }
+};
+
 class WeakBlock : public Object {
   friend class Object;
+  friend class ObjectWithWeak;
   friend struct Object::copy_transaction;
   template <typename T>
   friend class own;
@@ -174,6 +371,11 @@ class WeakBlock : public Object {
   intptr_t org_counter;
   WeakBlock(Object* target, intptr_t org_counter) noexcept;
   WeakBlock(const WeakBlock&) = delete;
+  void operator=(const WeakBlock&) = delete;
+
+  // WeakBlocks are allocated from thread-local pools.
+  static void* operator new(std::size_t size);
+  static void operator delete(void* ptr, std::size_t size) noexcept;
 
  protected:
   void copy_to(Object*& dst) override;
@@ -181,6 +383,63 @@ class WeakBlock : public Object {
   Object* get_target() noexcept override;
 };
 
+// Counters of the WeakBlock pool of the calling thread.
+struct WeakBlockPoolStats {
+  // WeakBlocks allocated by this thread.
+  std::uint64_t blocks;
+  // Heap allocations made to serve them.
+  std::uint64_t slabs;
+};
+
+WeakBlockPoolStats get_weak_block_pool_stats() noexcept;
+
+#ifdef LTM_STATS
+// Counters of lifetime manager activity, summed over all threads.
+struct Stats {
+  // Objects constructed and destroyed, weak blocks are not included.
+  std::uint64_t objects_created;
+  std::uint64_t objects_disposed;
+  std::uint64_t weak_blocks_allocated;
+  std::uint64_t weak_blocks_freed;
+  // Assignments to owning pointers: unowned objects adopted, shared objects
+  // retained and objects copied.
+  std::uint64_t adopted;
+  std::uint64_t shared_retained;
+  std::uint64_t copied;
+  std::uint64_t weaks_copied;
+  // Completed outermost copy transactions and objects copied inside them.
+  std::uint64_t transactions;
+  std::uint64_t transaction_objects;
+  // The biggest number of objects copied in one transaction.
+  std::uint64_t peak_transaction_objects;
+};
+
+// Returns counters accumulated since the last reset_stats().
+Stats get_stats();
+void reset_stats();
+#endif  // LTM_STATS
+
+// Base for objects that are expected to be weakly referenced.
+// It keeps its counter in place even if it has weak pointers, so retain
+// and release of pins don't touch the weak block. Weak pointers refer to
+// a separate tombstone WeakBlock that loses its target on destruction.
+// Costs one additional pointer per object.
+class ObjectWithWeak : public Object {
+  friend class Object;
+
+ protected:
+  ObjectWithWeak() noexcept;
+  ObjectWithWeak(const ObjectWithWeak& src) noexcept;
+  ~ObjectWithWeak() noexcept override;
+  // Keeps the tombstone of this object.
+  ObjectWithWeak& operator=(const ObjectWithWeak&) noexcept { return *this; }
+
+  Object* get_weak() override;
+
+ private:
+  WeakBlock* tombstone = nullptr;
+};
+
 // Owning pointer
 template <typename T>
 class own {
@@ -192,13 +451,24 @@ class own {
   friend class ipin;
   template <typename U>
   friend class iweak;
+  template <typename U>
+  friend void dispose_in_background(own<U>&& root) noexcept;
+  template <typename U>
+  friend own<U> parallel_copy(const own<U>& src, std::size_t threads);
+  template <typename U>
+  friend void compact(own<U>& root);
+  friend class port_base;
+  friend class thread_pool;
+  template <typename U>
+  friend class rcu;
+  friend class arena;
 
   mutable Object* target;
 
  public:
   own() noexcept : target() {}
   own(std::nullptr_t) noexcept : target() {}
-  own(const own& src) { Object::outer_copy_to(src.target, target); }
+  own(const own& src) { Object::inplace_copy_to(src.target, target); }
   own(own&& src) noexcept : target(src.target) { src.target = nullptr; }
 
   template <typename U,
@@ -215,15 +485,13 @@ class own {
   operator void*() const noexcept { return target; }
 
   own<T>& operator=(const own& src) {
-    if (&src != this) {
-      Object* temp;
-      Object::outer_copy_to(src.target, temp);
-      Object::release(target);
-      target = temp;
-    }
+    if (&src != this)
+      Object::assign_copy_to(src.target, target);
     return *this;
   }
 
+  own<T>& operator=(own& src) { return *this = static_cast<const own&>(src); }
+
   own<T>& operator=(own&& src) noexcept {
     Object::release(target);
     target = src.target;
@@ -297,6 +565,16 @@ class own {
     return ::ltm::pin<U>(*this);
   }
 
+  // Makes dst a copy of this hierarchy, reusing dst objects that have
+  // the same dynamic types as their sources and are LTM_ASSIGNABLE.
+  // Only mismatching subtrees get allocated. Weak pointers inside of the
+  // hierarchy are mapped to the destination, as by the regular copy, and
+  // existing weaks to reused objects stay valid.
+  // Objects nested deeper than 256 levels are copied instead of reused,
+  // use LTM_ITERATIVE_COPYABLE to copy such hierarchies without recursion.
+  // If it throws, dst is left partially assigned.
+  void assign_into(own& dst) const { Object::assign_into(target, dst.target); }
+
 #ifdef TESTS
   void check(uintptr_t flags, uintptr_t weak_flags = 0) const {
     Object::check(target, flags, weak_flags);
@@ -313,6 +591,8 @@ class pin {
   friend class weak;
   template <typename U>
   friend class iweak;
+  template <typename K, typename V>
+  friend class weak_map;
 
   mutable Object* target;
 
@@ -337,7 +617,7 @@ class pin {
   operator void*() const noexcept { return target; }
   T& operator*() const noexcept { return *static_cast<T*>(target); }
   ~pin() noexcept { Object::release(target); }
-  bool has_weak() { return target && (target->counter & Object::WEAKLESS) == 0; }
+  bool has_weak() { return target && target->find_weak_block(); }
 
   template <typename BASE,
             typename = typename std::enable_if<
@@ -468,6 +748,9 @@ class weak {
   friend class pin;
   template <typename U>
   friend class ipin;
+  template <typename U>
+  friend class borrow;
+  friend class epoch;
 
   mutable Object* target;
 
@@ -498,30 +781,27 @@ class weak {
             typename = typename std::enable_if<
                 std::is_convertible<T*, BASE*>::value>::type>
   operator own<BASE>() const {
-    return own<BASE>(Object::get_target(target));
+    return pin<BASE>(*this);
   }
 
   template <typename BASE,
             typename = typename std::enable_if<
                 std::is_convertible<T*, BASE*>::value>::type>
   operator pin<BASE>() const noexcept {
-    return pin<BASE>(static_cast<BASE*>(Object::get_target(target)));
+    pin<BASE> r;
+    r.target = Object::lock(target);
+    return r;
   }
 
-  pin<T> operator->() const noexcept {
-    return pin<T>(Object::get_target(target));
-  }
+  pin<T> operator->() const noexcept { return *this; }
   operator bool() const noexcept {
     return Object::get_target(target) != nullptr;
   }
   operator void*() const noexcept { return Object::get_target(target); }
 
   weak<T>& operator=(const weak& src) noexcept {
-    if (&src != this) {
-      Object* temp = Object::get_weak(src.target);
-      Object::release(target);
-      target = temp;
-    }
+    if (&src != this)
+      Object::assign_weak(src.target, target);
     return *this;
   }
 
@@ -574,6 +854,115 @@ class weak {
 #endif
 };
 
+// Copy-on-write pointer.
+// Copies of cow<T> share the target, and mut() replaces a target that is
+// referenced from elsewhere with its private copy. cow<T> fields of the
+// copy share their targets with the original, so in a hierarchy built of
+// cow<T> fields only the nodes on the path to the mutated one get copied.
+// Use cow_edit to keep weak pointers between nodes copied on different
+// mut() calls.
+template <typename T>
+class cow {
+  template <typename U>
+  friend class cow;
+
+  mutable Object* target;
+
+ public:
+  cow() noexcept : target() {}
+  cow(std::nullptr_t) noexcept : target() {}
+  cow(const cow& src) noexcept : target(Object::retain(src.target)) {}
+  cow(cow&& src) noexcept : target(src.target) { src.target = nullptr; }
+
+  // Takes a new object, or copies an owned one.
+  template <typename U,
+            typename = typename std::enable_if<
+                std::is_convertible<U*, T*>::value>::type>
+  cow(U* src) {
+    Object::outer_copy_to(src, target);
+  }
+
+  template <typename U,
+            typename = typename std::enable_if<
+                std::is_convertible<U*, T*>::value>::type>
+  cow(const cow<U>& src) noexcept : target(Object::retain(src.target)) {}
+
+  ~cow() noexcept { Object::release(target); }
+
+  cow& operator=(const cow& src) noexcept {
+    Object* temp = Object::retain(src.target);
+    Object::release(target);
+    target = temp;
+    return *this;
+  }
+
+  cow& operator=(cow&& src) noexcept {
+    std::swap(target, src.target);
+    return *this;
+  }
+
+  const T* operator->() const noexcept { return static_cast<T*>(target); }
+  const T& operator*() const noexcept { return *static_cast<T*>(target); }
+  const T* get() const noexcept { return static_cast<T*>(target); }
+  operator bool() const noexcept { return target != nullptr; }
+  operator void*() const noexcept { return target; }
+
+  // Makes the target exclusively owned by this pointer and returns it.
+  T* mut() {
+    Object::unshare(target);
+    return static_cast<T*>(target);
+  }
+
+  template <typename U = T>
+  weak<U> weaked() const {
+    return ::ltm::weak<U>(static_cast<U*>(target));
+  }
+};
+
+// Scope of mutations of cow<T> hierarchies.
+// Weak pointers of objects copied by mut() inside of this scope get
+// resolved at its end: if their targets are copied in this scope they point
+// to the copies, otherwise to the original targets. Until then weak pointers
+// of the copies are empty and weak pointers to the originals must not be
+// dereferenced.
+class cow_edit {
+ public:
+  cow_edit();
+  ~cow_edit();
+  cow_edit(const cow_edit&) = delete;
+  void operator=(const cow_edit&) = delete;
+
+ private:
+  bool active;
+};
+
+// Scoped access to the target of a weak pointer. Unlike weak<T>::operator->
+// that makes a temporary pin on each call, it resolves and retains the
+// target once, so accesses inside of the scope are plain dereferences.
+// The target stays alive until the borrow ends. Null if the target is lost.
+//   if (ltm::borrow<Node> n{w})
+//     for (...) n->x += n->y;
+template <typename T>
+class borrow {
+ public:
+  template <typename U,
+            typename = typename std::enable_if<
+                std::is_convertible<U*, T*>::value>::type>
+  explicit borrow(const weak<U>& src) noexcept
+      : target(Object::lock(src.target)) {}
+  ~borrow() noexcept { Object::release(target); }
+  borrow(const borrow&) = delete;
+  void operator=(const borrow&) = delete;
+
+  T* get() const noexcept { return static_cast<T*>(target); }
+  T* operator->() const noexcept { return static_cast<T*>(target); }
+  T& operator*() const noexcept { return *static_cast<T*>(target); }
+  explicit operator bool() const noexcept { return target != nullptr; }
+
+ private:
+  Object* target;
+};
+
 template <
     typename A,
     typename B,
@@ -629,6 +1018,711 @@ class ipin {
   INTERFACE* operator->() { return impl; }
 };
 
+// Callback bound to an object held by a weak pointer, that does nothing
+// once the object is gone. It calls either a method of the object or a
+// functor that gets the object as its first parameter. Copies of objects
+// holding delegates get them bound to copies of their targets, the same
+// way as weak<T> fields. Functors must be trivially copyable and not
+// bigger than a member pointer, they are stored in place, so delegates
+// never allocate. Keep the state in the target object.
+//   delegate<void(char)> on_key{child, &Node::set_c};
+//   delegate<void(char)> on_key{child, [](Node& me, char c) { me.c = c; }};
+//   on_key('x');
+template <typename R, typename... ARGS>
+class delegate<R(ARGS...)> {
+  template <typename... A>
+  friend class signal;
+  struct Probe;
+  union Storage {
+    void (Probe::*method)();
+    void* ptr;
+  };
+
+ public:
+  delegate() noexcept : invoke(nullptr), fn_storage() {}
+  delegate(std::nullptr_t) noexcept : invoke(nullptr), fn_storage() {}
+
+  template <typename T, typename F>
+  delegate(weak<T> receiver, F fn) noexcept
+      : target(std::move(static_cast<weak<Object>&>(receiver))),
+        invoke(&call<T, F>),
+        fn_storage() {
+    static_assert(sizeof(F) <= sizeof(Storage) &&
+                      alignof(F) <= alignof(Storage),
+                  "the functor doesn't fit in a delegate");
+    static_assert(std::is_trivially_copyable<F>::value,
+                  "the functor must be trivially copyable");
+    new (&fn_storage) F(fn);
+  }
+
+  template <typename T, typename F>
+  delegate(const pin<T>& receiver, F fn) noexcept
+      : delegate(weak<T>(receiver), fn) {}
+
+  template <typename T, typename F>
+  delegate(const own<T>& receiver, F fn) noexcept
+      : delegate(weak<T>(receiver), fn) {}
+
+  // Returns R() if the delegate is empty or its target is gone.
+  R operator()(ARGS... args) const {
+    pin<Object> t = target;  // empty if the delegate is
+    if (!t)
+      return R();
+    return invoke(&*t, &fn_storage, std::forward<ARGS>(args)...);
+  }
+
+  explicit operator bool() const noexcept { return target; }
+
+ private:
+  template <typename T, typename F>
+  static R call(Object* target, const void* fn, ARGS... args) {
+    return apply(*static_cast<T*>(target), *static_cast<const F*>(fn),
+                 std::forward<ARGS>(args)...);
+  }
+
+  template <typename T, typename M, typename C>
+  static R apply(T& target, M C::*method, ARGS&&... args) {
+    return (target.*method)(std::forward<ARGS>(args)...);
+  }
+
+  template <typename T, typename F>
+  static R apply(T& target, const F& fn, ARGS&&... args) {
+    return fn(target, std::forward<ARGS>(args)...);
+  }
+
+  weak<Object> target;
+  R (*invoke)(Object* target, const void* fn, ARGS... args);
+  Storage fn_storage;
+};
+
+// List of delegates called together. Subscribers are held weakly, entries
+// of the gone ones are dropped while dispatching. Copies of objects holding
+// signals get subscriptions bound to the copies of subscribers, the same
+// way as weak<T> fields.
+// Dispatch goes in batches: targets of a batch are pinned first, then
+// called. Subscribers connected by handlers get the next event, ones
+// disconnected by handlers are skipped. Subscribers released by handlers
+// still get the event if they are pinned by the running batch.
+//   signal<int> changed;
+//   changed.connect(view, &View::on_change);
+//   changed(42);
+template <typename... ARGS>
+class signal {
+ public:
+  signal() = default;
+  signal(const signal& src) : slots(src.slots) {}
+  signal& operator=(const signal& src) {
+    slots = src.slots;
+    return *this;
+  }
+
+  // Receiver is a weak, pin or own pointer, see delegate for functors.
+  template <typename P, typename F>
+  void connect(const P& receiver, F fn) {
+    slots.push_back(delegate<void(ARGS...)>(receiver, fn));
+  }
+
+  // Disconnects all delegates of the subscriber.
+  void disconnect(const void* subscriber) noexcept {
+    for (auto& d : slots) {
+      if (static_cast<void*>(d.target) == subscriber)
+        d = nullptr;
+    }
+  }
+
+  void operator()(const ARGS&... args) {
+    const std::size_t BATCH = 16;
+    pin<Object> pins[BATCH];
+    std::size_t index[BATCH];
+    dispatch_scope scope{*this};
+    for (std::size_t end = slots.size(); scope.read < end;) {
+      std::size_t n = 0;
+      for (; n < BATCH && scope.read < end; scope.read++) {
+        auto& d = slots[scope.read];
+        pins[n] = d.target;
+        if (!pins[n])
+          continue;
+        if (scope.compacting) {
+          if (scope.write != scope.read)
+            slots[scope.write] = std::move(d);
+          index[n++] = scope.write++;
+        } else {
+          index[n++] = scope.read;
+        }
+      }
+      for (std::size_t i = 0; i < n; i++) {
+        auto& d = slots[index[i]];
+        if (d.target) {
+          // Handlers may connect and reallocate `slots`, keep a local copy.
+          auto invoke = d.invoke;
+          auto fn = d.fn_storage;
+          invoke(&*pins[i], &fn, args...);
+        }
+        pins[i] = nullptr;
+      }
+    }
+  }
+
+  // Number of connections, including the ones not pruned yet.
+  std::size_t size() const noexcept { return slots.size(); }
+  bool empty() const noexcept { return slots.empty(); }
+  void clear() noexcept {
+    if (!dispatching) {
+      slots.clear();
+      return;
+    }
+    for (auto& d : slots)
+      d = nullptr;
+  }
+
+ private:
+  // Compacts entries of the outermost dispatch, including after a throw.
+  struct dispatch_scope {
+    signal& owner;
+    bool compacting;
+    std::size_t read = 0;
+    std::size_t write = 0;
+
+    explicit dispatch_scope(signal& owner) noexcept
+        : owner(owner), compacting(owner.dispatching++ == 0) {}
+    ~dispatch_scope() {
+      owner.dispatching--;
+      if (compacting && write != read) {
+        owner.slots.erase(owner.slots.begin() + write,
+                          owner.slots.begin() + read);
+      }
+    }
+  };
+
+  std::vector<delegate<void(ARGS...)>> slots;
+  int dispatching = 0;
+};
+
+// Releases the hierarchy on the background reclamation thread, that is
+// started on first use, so the calling thread doesn't pay for its destruction.
+// The hierarchy must be detached: it must not share non-atomic objects with
+// the rest of the application.
+template <typename T>
+void dispose_in_background(own<T>&& root) noexcept {
+  Object::release_in_background(root.target);
+  root.target = nullptr;
+}
+
+// Blocks until the background reclamation thread disposes everything
+// passed to it so far.
+void wait_for_background_disposal();
+
+// Copies the hierarchy on up to `threads` threads, including the calling one.
+// The top levels are copied on the calling thread, and the postponed own<T>
+// fields of LTM_ITERATIVE_COPYABLE objects below them are distributed among
+// threads as independent subtrees. Weak pointers are fixed up at the end,
+// the same way as by the regular copy.
+// While copying, the source must not be accessed by other threads, and
+// counters of shared objects it refers to are modified atomically.
+template <typename T>
+own<T> parallel_copy(const own<T>& src, std::size_t threads) {
+  own<T> r;
+  r.target = Object::parallel_copy(src.target, threads);
+  return r;
+}
+
+// Vector of owning pointers.
+// Copies of the whole vector or of its ranges are made in one copy
+// transaction, so weak pointers between elements of the copied range
+// point to the copies.
+template <typename T>
+class own_vector {
+  static_assert(sizeof(own<T>) == sizeof(Object*), "own<T> is a pointer");
+
+ public:
+  using value_type = own<T>;
+  using iterator = typename std::vector<own<T>>::iterator;
+  using const_iterator = typename std::vector<own<T>>::const_iterator;
+
+  own_vector() noexcept {}
+  own_vector(const own_vector& src) { insert_copy(0, src, 0, src.size()); }
+  own_vector(own_vector&& src) noexcept : items(std::move(src.items)) {}
+  ~own_vector() noexcept { clear(); }
+
+  own_vector& operator=(const own_vector& src) {
+    if (&src != this) {
+      own_vector temp(src);
+      std::swap(items, temp.items);
+    }
+    return *this;
+  }
+
+  own_vector& operator=(own_vector&& src) noexcept {
+    clear();
+    items.swap(src.items);
+    return *this;
+  }
+
+  std::size_t size() const noexcept { return items.size(); }
+  bool empty() const noexcept { return items.empty(); }
+  void reserve(std::size_t n) { items.reserve(n); }
+
+  own<T>& operator[](std::size_t i) noexcept { return items[i]; }
+  const own<T>& operator[](std::size_t i) const noexcept { return items[i]; }
+  iterator begin() noexcept { return items.begin(); }
+  iterator end() noexcept { return items.end(); }
+  const_iterator begin() const noexcept { return items.begin(); }
+  const_iterator end() const noexcept { return items.end(); }
+
+  void push_back(const own<T>& v) { items.push_back(v); }
+  void push_back(own<T>&& v) { items.push_back(std::move(v)); }
+  void pop_back() noexcept { items.pop_back(); }
+
+  // Inserts copies of src[begin, end) at pos, src can be this vector.
+  void insert_copy(std::size_t pos,
+                   const own_vector& src,
+                   std::size_t begin,
+                   std::size_t end) {
+    std::vector<own<T>> copies;
+    copies.reserve(end - begin);
+    Object::copy(src.items.begin() + begin, src.items.begin() + end,
+                 std::back_inserter(copies));
+    items.insert(items.begin() + pos, std::make_move_iterator(copies.begin()),
+                 std::make_move_iterator(copies.end()));
+  }
+
+  void erase(std::size_t begin, std::size_t end) noexcept {
+    Object::release_all(slots() + begin, slots() + end);
+    items.erase(items.begin() + begin, items.begin() + end);
+  }
+
+  void clear() noexcept {
+    Object::release_all(slots(), slots() + items.size());
+    items.clear();
+  }
+
+ private:
+  Object** slots() noexcept { return reinterpret_cast<Object**>(items.data()); }
+
+  std::vector<own<T>> items;
+};
+
+// Hash map from objects to values, that holds its keys weakly.
+// Keys are hashed by their weak blocks, that stay in place while the map
+// holds them, so entries of dead objects don't disturb lookups. Such
+// entries are purged a few at a time on insertions and on growth.
+// Uses open addressing with linear probing and backward-shift deletion.
+// Keys must not be proxies.
+template <typename K, typename V>
+class weak_map {
+ public:
+  weak_map() noexcept {}
+
+  // Weaks of the copy can be retargeted by the enclosing copy transaction,
+  // so the copy is rehashed on first use.
+  weak_map(const weak_map& src) : slots(src.slots.size()), count(src.count) {
+    stale = count != 0;
+    for (std::size_t i = 0; i < slots.size(); i++) {
+      if (src.slots[i].key) {
+        Object::outer_copy_to(src.slots[i].key, slots[i].key);
+        slots[i].value = src.slots[i].value;
+      }
+    }
+  }
+
+  weak_map(weak_map&& src) noexcept
+      : slots(std::move(src.slots)),
+        count(src.count),
+        cursor(src.cursor),
+        stale(src.stale) {
+    src.slots.clear();
+    src.count = 0;
+  }
+
+  ~weak_map() noexcept { clear(); }
+
+  weak_map& operator=(const weak_map& src) {
+    if (&src != this)
+      *this = weak_map(src);
+    return *this;
+  }
+
+  weak_map& operator=(weak_map&& src) noexcept {
+    clear();
+    std::swap(slots, src.slots);
+    std::swap(count, src.count);
+    std::swap(cursor, src.cursor);
+    std::swap(stale, src.stale);
+    return *this;
+  }
+
+  // Includes entries of dead objects not purged yet.
+  std::size_t size() const noexcept { return count; }
+
+  // Returns the value of a live key or null.
+  V* find(const pin<K>& key) {
+    std::size_t i = locate(key);
+    return i == npos ? nullptr : &slots[i].value;
+  }
+
+  // Returns the value of a key, inserting the default one if missing.
+  // Makes the key weakly referenced. The key must not be null.
+  V& operator[](const pin<K>& key) {
+    if (!key.target)
+      abort();  // null has no weak block to key the entry
+    std::size_t i = locate(key);
+    if (i != npos)
+      return slots[i].value;
+    for (int step = 0; step < 2 && count; step++)
+      purge_at_cursor();
+    if ((count + 1) * 4 > slots.size() * 3)
+      rehash(slots.empty() ? 8 : slots.size() * 2);
+    Object* id = Object::get_weak(key.target);
+    for (i = home(id); slots[i].key; i = (i + 1) & mask())
+      ;
+    slots[i].key = id;
+    count++;
+    return slots[i].value;
+  }
+
+  bool erase(const pin<K>& key) noexcept {
+    std::size_t i = locate(key);
+    if (i == npos)
+      return false;
+    remove_at(i);
+    return true;
+  }
+
+  // Purges all entries of dead objects.
+  void sweep() {
+    if (count)
+      rehash(slots.size());
+  }
+
+  void clear() noexcept {
+    for (auto& s : slots) {
+      Object::release(s.key);
+      s.key = nullptr;
+      s.value = V();
+    }
+    count = 0;
+    stale = false;
+  }
+
+ private:
+  struct Slot {
+    Object* key = nullptr;  // retained weak block
+    V value{};
+  };
+
+  static constexpr std::size_t npos = ~std::size_t(0);
+
+  std::size_t mask() const noexcept { return slots.size() - 1; }
+
+  std::size_t home(Object* id) const noexcept {
+    std::uint64_t h = std::uint64_t(uintptr_t(id)) * 0x9E3779B97F4A7C15ull;
+    return std::size_t(h ^ (h >> 29)) & mask();
+  }
+
+  static bool is_dead(Object* id) noexcept {
+    return Object::get_target(id) == nullptr;
+  }
+
+  std::size_t locate(const pin<K>& key) {
+    if (stale)
+      rehash(slots.size());
+    if (!count || !key.target)
+      return npos;
+    Object* id = key.target->find_weak_block();
+    if (!id)
+      return npos;
+    for (std::size_t i = home(id); slots[i].key; i = (i + 1) & mask()) {
+      if (slots[i].key == id)
+        return i;
+    }
+    return npos;
+  }
+
+  void purge_at_cursor() noexcept {
+    cursor &= mask();
+    if (slots[cursor].key && is_dead(slots[cursor].key))
+      remove_at(cursor);  // a shifted entry takes its place
+    else
+      cursor++;
+  }
+
+  void remove_at(std::size_t i) noexcept {
+    Object* key = slots[i].key;
+    // Destroyed once the table is consistent, it can refer to the map.
+    V value = std::move(slots[i].value);
+    (void)value;
+    for (std::size_t j = (i + 1) & mask(); slots[j].key; j = (j + 1) & mask()) {
+      // Entries that can't be found from their home after the gap is
+      // made move into the gap.
+      if (((j - home(slots[j].key)) & mask()) >= ((j - i) & mask())) {
+        slots[i].key = slots[j].key;
+        slots[i].value = std::move(slots[j].value);
+        i = j;
+      }
+    }
+    slots[i].key = nullptr;
+    slots[i].value = V();
+    count--;
+    Object::release(key);
+  }
+
+  void rehash(std::size_t capacity) {
+    std::vector<Slot> old(capacity);
+    std::swap(old, slots);
+    count = 0;
+    cursor = 0;
+    stale = false;
+    for (auto& s : old) {
+      if (!s.key)
+        continue;
+      if (is_dead(s.key)) {
+        Object::release(s.key);
+        continue;
+      }
+      std::size_t i = home(s.key);
+      while (slots[i].key)
+        i = (i + 1) & mask();
+      slots[i].key = s.key;
+      slots[i].value = std::move(s.value);
+      count++;
+    }
+  }
+
+  std::vector<Slot> slots;
+  std::size_t count = 0;
+  std::size_t cursor = 0;
+  bool stale = false;
+};
+
+// Type-independent part of port<T>.
+class port_base {
+ public:
+  // Wakes up receivers, after that they get null once the port is empty.
+  // Domains posted to a closed port are disposed.
+  void close();
+
+ protected:
+  port_base();
+  ~port_base() noexcept;
+  port_base(const port_base&) = delete;
+  void operator=(const port_base&) = delete;
+
+  template <typename T>
+  static Object*& target_of(own<T>& p) noexcept {
+    return p.target;
+  }
+
+  // Takes the domain and nulls its pointer.
+  void post(Object*& domain);
+  Object* receive();
+  Object* try_receive() noexcept;
+
+ private:
+  struct State;
+  State* state;
+};
+
+// Queue that passes object domains between threads without copying them.
+// A domain is a detached hierarchy: nothing outside of it holds pins or
+// weaks to its objects or to the shared objects it refers to, and its
+// weaks don't point outside. Debug builds verify it on post.
+// Posting transfers all objects of the domain to the receiving thread.
+template <typename T>
+class port : public port_base {
+ public:
+  port() {}
+
+  void post(own<T>&& domain) { port_base::post(target_of(domain)); }
+
+  // Blocks until a domain is posted, returns null if the port is closed
+  // and empty.
+  own<T> receive() {
+    own<T> r;
+    target_of(r) = port_base::receive();
+    return r;
+  }
+
+  // Returns null if the port is empty.
+  own<T> try_receive() noexcept {
+    own<T> r;
+    target_of(r) = port_base::try_receive();
+    return r;
+  }
+};
+
+// Unit of work of thread_pool.
+class task {
+ public:
+  virtual ~task() {}
+  virtual void run() = 0;
+};
+
+// Task that owns the domain it operates on.
+template <typename T, typename F>
+class domain_task : public task {
+ public:
+  domain_task(own<T>&& domain, F fn)
+      : domain(std::move(domain)), fn(std::move(fn)) {}
+  void run() override { fn(domain); }
+
+ private:
+  own<T> domain;
+  F fn;
+};
+
+template <typename F>
+class function_task : public task {
+ public:
+  explicit function_task(F fn) : fn(std::move(fn)) {}
+  void run() override { fn(); }
+
+ private:
+  F fn;
+};
+
+// Runs tasks on a fixed set of threads. Each thread has its own queue,
+// tasks started from a worker go to its queue, and idle workers steal the
+// oldest tasks from the others. Tasks are destroyed (and their domains
+// disposed) on the threads that run them. Tasks must not throw.
+class thread_pool {
+ public:
+  // Zero means the number of hardware threads.
+  explicit thread_pool(std::size_t threads = 0);
+  // Waits for all tasks.
+  ~thread_pool() noexcept;
+  thread_pool(const thread_pool&) = delete;
+  void operator=(const thread_pool&) = delete;
+
+  std::size_t size() const noexcept;
+
+  void run(std::unique_ptr<task> t);
+
+  template <typename F>
+  void run(F fn) {
+    run(std::unique_ptr<task>(new function_task<F>(std::move(fn))));
+  }
+
+  // Calls fn(domain) on a worker thread, that becomes the owner of the
+  // domain, see port<T>.
+  template <typename T, typename F>
+  void run(own<T>&& domain, F fn) {
+    check_domain(domain.target);
+    run(std::unique_ptr<task>(
+        new domain_task<T, F>(std::move(domain), std::move(fn))));
+  }
+
+  // Blocks until all started tasks are done, must not be called from tasks.
+  void wait();
+
+ private:
+  static void check_domain(Object* root);
+  void stop() noexcept;
+
+  struct State;
+  State* state;
+};
+
+// Read-side critical section of rcu<T> readers. While it exists, versions
+// published before it started are not disposed, so readers access them
+// without touching counters. Epochs can be nested.
+class epoch {
+ public:
+  epoch() noexcept;
+  ~epoch() noexcept;
+  epoch(const epoch&) = delete;
+  void operator=(const epoch&) = delete;
+
+  // Target of a weak pointer inside of a published version, not retained.
+  template <typename T>
+  static T* get(const weak<T>& w) noexcept {
+    return static_cast<T*>(Object::get_target(w.target));
+  }
+
+  // Blocks until all hierarchies retired so far are disposed. Must not be
+  // called inside of an epoch.
+  static void synchronize();
+
+ private:
+  // Disposes retired hierarchies no reader can see, tells if none left.
+  static bool reclaim();
+  friend class Object;
+};
+
+// Pointer to an immutable hierarchy, that is read by many threads.
+// Readers get it inside of an epoch and don't modify any counters of it.
+// Writers (serialized by the application) publish new versions, previous
+// ones get disposed after all epochs that could see them end.
+// Versions can share objects with each other, but not with readers.
+template <typename T>
+class rcu {
+ public:
+  rcu() noexcept : target(nullptr) {}
+  explicit rcu(own<T>&& v) noexcept : target(v.target) { v.target = nullptr; }
+  // There must be no readers.
+  ~rcu() noexcept { Object::release(target.load(std::memory_order_relaxed)); }
+  rcu(const rcu&) = delete;
+  void operator=(const rcu&) = delete;
+
+  // Must be called inside of an epoch, the result is valid until it ends.
+  const T* get() const noexcept {
+    return static_cast<const T*>(target.load(std::memory_order_seq_cst));
+  }
+
+  void publish(own<T>&& v) {
+    Object* prev = target.exchange(v.target, std::memory_order_seq_cst);
+    v.target = nullptr;
+    Object::retire(prev);
+  }
+
+ private:
+  std::atomic<Object*> target;
+};
+
+// Replaces the hierarchy with its copy, that is allocated in depth-first
+// order in a few big memory chunks, so its traversals miss cache less.
+// Each chunk is freed when all objects in it are gone. Weak pointers to
+// the objects of the hierarchy, from inside and from outside of it, are
+// moved to the copies. Shared objects are not moved. Pins to its objects
+// must not exist, they would keep the detached originals.
+template <typename T>
+void compact(own<T>& root) {
+  Object::compact(root.target);
+}
+
+// Scope in which objects created on this thread (by make, set, copies and
+// plain new) are allocated in big memory chunks by bumping a pointer, so
+// hierarchies that are built and dropped inside of it cost no malloc/free
+// per object. Disposal runs destructors, and each chunk is freed at once
+// when the scope and all objects in it are gone. The innermost scope is
+// used.
+// Objects must not outlive the scope unless they are owned by roots passed
+// to keep(), since one such object holds its whole chunk. Debug builds
+// check it at the end of the scope.
+//   {
+//     ltm::arena scope;
+//     auto doc = parse(request);
+//     reply(process(doc));
+//   }
+class arena {
+ public:
+  arena();
+  ~arena() noexcept;
+  arena(const arena&) = delete;
+  void operator=(const arena&) = delete;
+
+  // Allows the hierarchy to outlive the scope.
+  template <typename T>
+  void keep(const own<T>& root) {
+    keep_root(root.target);
+  }
+
+ private:
+  void keep_root(Object* root);
+
+  struct State;
+  State* state;
+};
+
 template <typename C, typename T>
 void mc(C& container, std::initializer_list<T> v) {
   container.reserve(v.size());
@@ -669,4 +1763,27 @@ struct hash<ltm::pin<T>> {
 #define LTM_COPYABLE(CLASS) \
   void copy_to(Object*& d) override { d = new CLASS(*this); }
 
+// Same as LTM_COPYABLE, but own<T> fields of the copy get copied not from
+// inside of the copy constructor but later, in a loop, so copying of deep
+// hierarchies (like own<T>-linked lists) doesn't consume stack.
+// The copy constructor must copy-construct own<T> fields in place (not
+// assign them) and must not access their targets.
+#define LTM_ITERATIVE_COPYABLE(CLASS)              \
+  void copy_to(Object*& d) override {              \
+    ::ltm::Object::deferred_copy_scope deferred;   \
+    d = new CLASS(*this);                          \
+  }
+
+// Used along with LTM_COPYABLE, allows own<T>::assign_into to reuse objects
+// of this class. Fields are assigned by the copy assignment operator of
+// CLASS, in which own<T> fields reuse their targets the same way.
+// Objects are not assignable, so CLASS should derive from Assignable<>.
+#define LTM_ASSIGNABLE(CLASS)                      \
+  bool assign_to(Object* d) override {             \
+    if (typeid(*d) != typeid(CLASS))               \
+      return false;                                \
+    *static_cast<CLASS*>(d) = *this;               \
+    return true;                                   \
+  }
+
 #endif  // E_LTM_H_
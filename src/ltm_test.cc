@@ -13,6 +13,7 @@ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 See the License for the specific language governing permissions and
 limitations under the License.
 */
+#include <atomic>
 #include <cassert>
 #include <functional>
 #include <iterator>
@@ -26,6 +27,9 @@ using std::vector;
 #include <string>
 using std::string;
 
+#include <thread>
+using std::thread;
+
 #include "ltm.h"
 using ltm::Object;
 using ltm::own;
@@ -210,6 +214,122 @@ void weak_handlers() {
   r2->handler('y');
 }
 
+struct NodeWithDelegate : Object {
+  own<NodeWithDelegate> child;
+  char c;
+  ltm::delegate<void(char)> handler;
+
+  NodeWithDelegate(char c, const pin<NodeWithDelegate>& child = nullptr)
+      : child(child), c(c) {}
+  void set_c(char v) { c = v; }
+  LTM_COPYABLE(NodeWithDelegate)
+};
+
+void delegate_test() {
+  auto root = own<NodeWithDelegate>::make('a', pin<NodeWithDelegate>::make('b'));
+  root->handler = {root->child, &NodeWithDelegate::set_c};
+  root->handler('x');
+  assert(root->child->c == 'x');
+  auto r2 = root;
+  r2->handler('y');  // bound to the copy of the child
+  assert(r2->child->c == 'y' && root->child->c == 'x');
+  root->handler = {root->child,
+                   [](NodeWithDelegate& me, char p) { me.c = p + 1; }};
+  root->handler('x');
+  assert(root->child->c == 'y');
+  root->child = nullptr;
+  assert(!root->handler);
+  root->handler('z');  // skipped
+  ltm::delegate<int(int)> square{
+      r2, [](NodeWithDelegate&, int v) { return v * v; }};
+  assert(square(3) == 9);
+  r2 = nullptr;
+  assert(square(3) == 0);
+  assert(!ltm::delegate<void()>());
+  static_assert(sizeof(ltm::delegate<void()>) <= 4 * sizeof(void*),
+                "delegates should be small");
+}
+
+struct Subscriber : Object {
+  int sum = 0;
+  ltm::signal<int>* source = nullptr;
+
+  void on_event(int v) { sum += v; }
+  LTM_COPYABLE(Subscriber)
+};
+
+struct Publisher : Object {
+  own<Subscriber> a, b;
+  ltm::signal<int> changed;
+  LTM_COPYABLE(Publisher)
+};
+
+void signal_test() {
+  auto p = own<Publisher>::make();
+  p->a = own<Subscriber>::make();
+  p->b = own<Subscriber>::make();
+  p->changed.connect(p->a, &Subscriber::on_event);
+  p->changed.connect(p->b, [](Subscriber& me, int v) { me.sum += v * 10; });
+  p->changed(1);
+  assert(p->a->sum == 1 && p->b->sum == 10);
+
+  auto p2 = p;  // subscriptions are bound to the copies
+  p2->changed(2);
+  assert(p2->a->sum == 3 && p2->b->sum == 30 && p->a->sum == 1);
+
+  // Gone subscribers are pruned while dispatching.
+  std::vector<own<Subscriber>> many;
+  for (int i = 0; i < 40; i++) {
+    many.push_back(own<Subscriber>::make());
+    p->changed.connect(many.back(), &Subscriber::on_event);
+  }
+  for (int i = 0; i < 40; i += 2)
+    many[i] = nullptr;
+  p->b = nullptr;
+  p->changed(1);
+  assert(p->changed.size() == 21 && p->a->sum == 2 && many[1]->sum == 1);
+
+  p->changed.disconnect(p->a);
+  p->changed(1);
+  assert(p->changed.size() == 20 && p->a->sum == 2 && many[1]->sum == 2);
+
+  // Handlers connect, disconnect and dispatch reentrantly.
+  ltm::signal<int> s;
+  auto late = own<Subscriber>::make();
+  auto x = own<Subscriber>::make();
+  x->source = &s;
+  s.connect(x, [](Subscriber& me, int v) {
+    me.sum += v;
+    if (v == 1)
+      (*me.source)(2);
+  });
+  s.connect(late, &Subscriber::on_event);
+  s.connect(x, [](Subscriber& me, int) { me.source->disconnect(&me); });
+  s(1);
+  assert(x->sum == 3 && late->sum == 3);
+  s.connect(late, &Subscriber::on_event);
+  s(1);
+  assert(s.size() == 2 && x->sum == 3 && late->sum == 5);
+
+  // A handler with captured state connects enough to reallocate the slots.
+  ltm::signal<int> grow;
+  std::vector<own<Subscriber>> added;
+  auto host = own<Subscriber>::make();
+  host->source = &grow;
+  int scale = 7;
+  grow.connect(host, [scale, &added](Subscriber& me, int v) {
+    for (int i = 0; i < 40; i++) {
+      added.push_back(own<Subscriber>::make());
+      me.source->connect(added.back(), &Subscriber::on_event);
+    }
+    me.sum += v * scale;
+  });
+  grow(1);
+  assert(host->sum == 7 && grow.size() == 41 && added[0]->sum == 0);
+  grow(1);
+  assert(host->sum == 14 && grow.size() == 81 && added[0]->sum == 1);
+}
+
 struct IPaintable : Object {
   virtual void paint(Point* p) = 0;
   virtual int get_width() = 0;
@@ -259,13 +379,738 @@ void interaface_test() {
     i->method2(11);
 }
 
+struct SharedInfo : Object {
+  int value;
+
+  SharedInfo(int value) : value(value) {
+    make_shared();
+    make_atomic();
+  }
+
+  void copy_to(Object*& d) override { d = new SharedInfo(*this); }
+};
+
+void atomic_test() {
+  own<SharedInfo> info = new SharedInfo(42);
+  weak<SharedInfo> w = info;
+  info.check(lc::COUNTER_STEP + lc::OWNED + lc::SHARED + lc::ATOMIC,
+             2 * lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS + lc::ATOMIC);
+  vector<thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([&] {
+      for (int j = 0; j < 10000; j++) {
+        own<SharedInfo> copy = info;
+        pin<SharedInfo> p = w;
+        weak<SharedInfo> w2 = p;
+        assert(w2.pinned()->value == 42);
+      }
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+  info.check(lc::COUNTER_STEP + lc::OWNED + lc::SHARED + lc::ATOMIC,
+             2 * lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS + lc::ATOMIC);
+
+  thread([moved = std::move(info)] {}).join();
+  assert(!w);
+}
+
+void atomic_lock_release_test() {
+  // Weaks are locked on a worker while the owner releases the target.
+  for (int i = 0; i < 200; i++) {
+    own<SharedInfo> info = new SharedInfo(i);
+    weak<SharedInfo> w = info;
+    std::atomic<bool> started{false};
+    thread worker([&, w] {
+      for (int n = 0;; n++) {
+        pin<SharedInfo> p = w;
+        if (!p)
+          break;
+        assert(p->value == i);
+        if (n == 10)
+          started = true;
+      }
+    });
+    while (!started)
+      std::this_thread::yield();
+    info = nullptr;
+    worker.join();
+    assert(!w);
+  }
+}
+
+void weak_block_pool_test() {
+  auto initial = ltm::get_weak_block_pool_stats();
+  vector<own<Point>> points(1000);
+  vector<weak<Point>> weaks;
+  for (auto& p : points) {
+    p = new Point;
+    weaks.push_back(p);
+  }
+  auto filled = ltm::get_weak_block_pool_stats();
+  assert(filled.blocks - initial.blocks == points.size());
+  assert(filled.slabs - initial.slabs < points.size() / 32);
+
+  auto copy = points;
+  weaks.clear();
+  points.clear();
+  for (auto& p : copy)
+    weaks.push_back(p);
+  auto refilled = ltm::get_weak_block_pool_stats();
+  assert(refilled.blocks - filled.blocks == copy.size());
+  assert(refilled.slabs == filled.slabs);
+}
+
+void weak_block_pool_remote_free_test() {
+  // Blocks freed by a running thread come back to this one.
+  vector<own<Point>> points;
+  std::atomic<bool> full{false};
+  thread consumer([&] {
+    for (int i = 0; i < 4; i++) {
+      while (!full)
+        std::this_thread::yield();
+      points.clear();
+      full = false;
+    }
+  });
+  std::uint64_t slabs[4];
+  for (auto& s : slabs) {
+    points.resize(4000);
+    for (auto& p : points) {
+      p = new Point;
+      weak<Point> w = p;
+    }
+    full = true;
+    while (full)
+      std::this_thread::yield();
+    s = ltm::get_weak_block_pool_stats().slabs;
+  }
+  consumer.join();
+  assert(slabs[3] - slabs[1] < 4000 / 64 / 4);
+}
+
+struct InlineXrefNode : ltm::ObjectWithWeak {
+  char c;
+  own<InlineXrefNode> left, right;
+  weak<InlineXrefNode> xref;
+
+  InlineXrefNode(char c,
+                 InlineXrefNode* left = nullptr,
+                 InlineXrefNode* right = nullptr)
+      : c(c), left(left), right(right) {
+    if (left)
+      left->xref = this;
+    if (right)
+      right->xref = this;
+  }
+
+  void copy_to(Object*& d) override { d = new InlineXrefNode(*this); }
+};
+
+void check_inline_xref_tree(const own<InlineXrefNode>& root) {
+  root.check(lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS + lc::INLINE_WEAK,
+             3 * lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS);
+  root->left.check(lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS +
+                   lc::INLINE_WEAK);
+  root->right.check(lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS +
+                    lc::INLINE_WEAK);
+  assert(root->left->xref.pinned() == root);
+  assert(root->right->xref.pinned() == root);
+}
+
+void object_with_weak_test() {
+  own<InlineXrefNode> root =
+      new InlineXrefNode('a', new InlineXrefNode('b'), new InlineXrefNode('c'));
+  check_inline_xref_tree(root);
+  {
+    pin<InlineXrefNode> p = root;
+    root.check(2 * lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS +
+                   lc::INLINE_WEAK,
+               3 * lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS);
+  }
+  own<InlineXrefNode> r2 = root;
+  check_inline_xref_tree(root);
+  check_inline_xref_tree(r2);
+
+  r2->left->xref = r2->right;
+  r2->right->xref = r2->left;
+  auto r3 = r2;
+  assert(r3->left->xref.pinned() == r3->right);
+  assert(r3->right->xref.pinned() == r3->left);
+  r3.check(lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS + lc::INLINE_WEAK);
+
+  weak<InlineXrefNode> w = r3->left;
+  r3 = nullptr;
+  assert(!w);
+  assert(r2->left->xref.pinned() == r2->right);
+}
+
+struct ListNode : Object {
+  int value;
+  own<ListNode> next;
+  weak<ListNode> prev;
+
+  explicit ListNode(int value) : value(value) {}
+
+  LTM_ITERATIVE_COPYABLE(ListNode);
+};
+
+void destroy_list(own<ListNode>& head) {
+  while (head) {
+    auto next = std::move(head->next);
+    head = std::move(next);
+  }
+}
+
+void iterative_copy_test() {
+  const int kLength = 100000;
+  own<ListNode> head = new ListNode(0);
+  ListNode* tail = &*head;
+  for (int i = 1; i < kLength; i++) {
+    tail->next = new ListNode(i);
+    tail->next->prev = tail;
+    tail = &*tail->next;
+  }
+  own<ListNode> copy = head;
+  int i = 0;
+  ListNode* prev = nullptr;
+  for (ListNode* n = &*copy; n; prev = n, n = n->next.operator->(), i++) {
+    assert(n->value == i);
+    assert(n->prev.pinned() == prev);
+  }
+  assert(i == kLength);
+  assert(copy->next->prev.pinned() == copy);
+  assert(head->next->prev.pinned() == head);
+  copy->next.check(lc::COUNTER_STEP + lc::OWNED,
+                   2 * lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS);
+  destroy_list(copy);
+  destroy_list(head);
+}
+
+struct Sibling : Object {
+  weak<Sibling> sibling;
+  bool* sibling_was_alive;
+
+  explicit Sibling(bool* sibling_was_alive)
+      : sibling_was_alive(sibling_was_alive) {}
+  ~Sibling() override {
+    if (sibling_was_alive)
+      *sibling_was_alive = bool(sibling);
+  }
+  LTM_COPYABLE(Sibling);
+};
+
+struct Siblings : Object {
+  own<Sibling> a, b;
+  LTM_COPYABLE(Siblings);
+};
+
+void iterative_dispose_test() {
+  own<ListNode> head = new ListNode(0);
+  for (int i = 1; i < 1000000; i++) {
+    own<ListNode> n = new ListNode(i);
+    n->next = std::move(head);
+    head = std::move(n);
+  }
+  weak<ListNode> w = head->next;
+  head = nullptr;
+  assert(!w);
+
+  // Weaks to the queued objects are already lost.
+  bool b_was_alive = true;
+  own<Siblings> s = new Siblings;
+  s->a = new Sibling(&b_was_alive);
+  s->b = new Sibling(nullptr);
+  s->a->sibling = s->b;
+  s = nullptr;
+  assert(!b_was_alive);
+
+  own<ListNode> list = new ListNode(0);
+  list->next = new ListNode(1);
+  weak<ListNode> w2 = list->next;
+  ltm::dispose_in_background(std::move(list));
+  assert(!list);
+  ltm::wait_for_background_disposal();
+  assert(!w2);
+}
+
+struct TreeNode : Object {
+  int id;
+  own<TreeNode> left, right;
+  weak<TreeNode> parent, cross;
+  weak<SharedInfo> info;
+
+  explicit TreeNode(int id) : id(id) {}
+  LTM_ITERATIVE_COPYABLE(TreeNode);
+};
+
+own<TreeNode> make_tree(int depth, int& id, const own<SharedInfo>& info) {
+  own<TreeNode> r = new TreeNode(id++);
+  r->info = info;
+  if (--depth > 0) {
+    r->left = make_tree(depth, id, info);
+    r->right = make_tree(depth, id, info);
+    r->left->parent = r;
+    r->right->parent = r;
+    r->left->cross = r->right->left;  // points to a different subtree
+  }
+  return r;
+}
+
+void check_tree_copy(const own<TreeNode>& orig,
+                     const own<TreeNode>& copy,
+                     const own<SharedInfo>& info) {
+  assert(orig != copy && orig->id == copy->id);
+  assert(copy->info.pinned() == info);
+  if (!orig->left) {
+    assert(!copy->left && !copy->right && !copy->cross);
+    return;
+  }
+  assert(copy->left->parent.pinned() == copy);
+  assert(copy->right->parent.pinned() == copy);
+  if (orig->left->cross)
+    assert(copy->left->cross.pinned() == copy->right->left);
+  check_tree_copy(orig->left, copy->left, info);
+  check_tree_copy(orig->right, copy->right, info);
+}
+
+void parallel_copy_test() {
+  own<SharedInfo> info = new SharedInfo(1);
+  int id = 0;
+  own<TreeNode> tree = make_tree(12, id, info);
+  for (std::size_t threads = 1; threads <= 4; threads++) {
+    own<TreeNode> copy = ltm::parallel_copy(tree, threads);
+    check_tree_copy(tree, copy, info);
+    tree.check(lc::COUNTER_STEP + lc::OWNED,
+               3 * lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS);
+  }
+  // Weaks to objects outside of the copied hierarchy are not changed.
+  own<TreeNode> subtree = ltm::parallel_copy(tree->left->left, 4);
+  assert(subtree->parent.pinned() == tree->left);
+  check_tree_copy(tree->left->left, subtree, info);
+}
+
+struct CowNode : Object {
+  int value;
+  ltm::cow<CowNode> left, right;
+  weak<CowNode> parent;
+
+  explicit CowNode(int value) : value(value) {}
+  LTM_COPYABLE(CowNode);
+};
+
+void cow_test() {
+  ltm::cow<CowNode> doc = new CowNode(1);
+  doc.mut()->left = new CowNode(2);
+  doc.mut()->right = new CowNode(3);
+  doc.mut()->left.mut()->parent = doc.weaked();
+  doc.mut()->right.mut()->parent = doc.weaked();
+  const CowNode* orig_root = doc.get();
+  assert(doc->left->parent.pinned() == orig_root);  // unique, not copied
+
+  auto snapshot = doc;
+  assert(snapshot.get() == orig_root);
+  {
+    ltm::cow_edit edit;
+    doc.mut()->left.mut()->value = 20;
+  }
+  assert(doc.get() != orig_root && snapshot.get() == orig_root);
+  assert(doc->left->value == 20 && snapshot->left->value == 2);
+  assert(doc->right == snapshot->right);  // not materialized
+  assert(doc->left->parent.pinned() == doc.get());
+  assert(snapshot->left->parent.pinned() == orig_root);
+
+  // Without cow_edit weaks of the copy point to originals.
+  auto s2 = doc;
+  doc.mut()->right.mut()->value = 30;
+  assert(doc->right->parent.pinned() == orig_root);
+  assert(snapshot->right->value == 3 && s2->right->value == 3);
+
+  weak<CowNode> w = snapshot->left.weaked();
+  snapshot = nullptr;
+  assert(!w);
+}
+
+struct AssignNode : ltm::Assignable<> {
+  int value;
+  own<AssignNode> left, right;
+  weak<AssignNode> parent;
+
+  explicit AssignNode(int value) : value(value) {}
+  LTM_COPYABLE(AssignNode);
+  LTM_ASSIGNABLE(AssignNode);
+};
+
+struct OtherAssignNode : AssignNode {
+  explicit OtherAssignNode(int value) : AssignNode(value) {}
+  LTM_COPYABLE(OtherAssignNode);
+  LTM_ASSIGNABLE(OtherAssignNode);
+};
+
+void assign_into_test() {
+  own<AssignNode> src = new AssignNode(1);
+  src->left = new AssignNode(2);
+  src->right = new AssignNode(3);
+  src->left->parent = src;
+  src->right->parent = src;
+  own<AssignNode> dst = src;
+  AssignNode* dst_root = &*dst;
+  AssignNode* dst_left = &*dst->left;
+  weak<AssignNode> outer = dst->left;
+
+  src->left->value = 20;
+  src->left->left = new AssignNode(4);
+  src->left->left->parent = src->left;
+  src->right = new OtherAssignNode(30);
+  src->right->parent = src;
+  src.assign_into(dst);
+
+  assert(&*dst == dst_root && &*dst->left == dst_left);
+  assert(dst->left->value == 20 && dst->right->value == 30);
+  assert(typeid(*dst->right) == typeid(OtherAssignNode));
+  assert(dst->left->parent.pinned() == dst);
+  assert(dst->right->parent.pinned() == dst);
+  assert(dst->left->left->parent.pinned() == dst->left);
+  assert(outer.pinned() == dst->left);
+  assert(src->left->parent.pinned() == src);
+  dst.check(lc::COUNTER_STEP + lc::OWNED,
+            3 * lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS);
+  dst->left.check(lc::COUNTER_STEP + lc::OWNED,
+                  3 * lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS);
+  src.check(lc::COUNTER_STEP + lc::OWNED,
+            3 * lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS);
+
+  // Mismatching root gets copied.
+  own<AssignNode> other = new OtherAssignNode(5);
+  src.assign_into(other);
+  assert(typeid(*other) == typeid(AssignNode) && other->left->value == 20);
+  assert(other->left->parent.pinned() == other);
+}
+
+struct AssignListNode : ltm::Assignable<> {
+  int value;
+  own<AssignListNode> next;
+  weak<AssignListNode> prev;
+
+  explicit AssignListNode(int value) : value(value) {}
+  LTM_ITERATIVE_COPYABLE(AssignListNode);
+  LTM_ASSIGNABLE(AssignListNode);
+};
+
+void deep_assign_into_test() {
+  const int kLength = 100000;
+  own<AssignListNode> src = new AssignListNode(0);
+  AssignListNode* tail = &*src;
+  for (int i = 1; i < kLength; i++) {
+    tail->next = new AssignListNode(i);
+    tail->next->prev = tail;
+    tail = &*tail->next;
+  }
+  own<AssignListNode> dst = src;
+  AssignListNode* dst_head = &*dst;
+  for (AssignListNode* n = &*src; n; n = n->next.operator->())
+    n->value *= 2;
+  src.assign_into(dst);
+
+  // The head is reused, the deep tail is copied without recursion.
+  assert(&*dst == dst_head);
+  int i = 0;
+  AssignListNode* prev = nullptr;
+  for (AssignListNode* n = &*dst; n; prev = n, n = n->next.operator->(), i++) {
+    assert(n->value == i * 2);
+    assert(n->prev.pinned() == prev);
+  }
+  assert(i == kLength);
+  for (own<AssignListNode>* l : {&src, &dst}) {
+    while (*l) {
+      auto next = std::move((*l)->next);
+      *l = std::move(next);
+    }
+  }
+}
+
+void own_vector_test() {
+  ltm::own_vector<XrefNode> v;
+  for (char c = 'a'; c < 'e'; c++)
+    v.push_back(new XrefNode(c));
+  v[1]->xref = v[0];
+  v[3]->xref = v[2];
+
+  ltm::own_vector<XrefNode> c = v;
+  assert(c.size() == 4 && c[0] != v[0] && c[3]->c == 'd');
+  assert(c[1]->xref.pinned() == c[0] && c[3]->xref.pinned() == c[2]);
+
+  // Weaks leaving the range point to the originals.
+  v.insert_copy(4, v, 1, 4);
+  assert(v.size() == 7 && v[4]->c == 'b' && v[6]->c == 'd');
+  assert(v[4]->xref.pinned() == v[0] && v[6]->xref.pinned() == v[5]);
+
+  std::vector<own<XrefNode>> sv{v[0], v[1]};
+  sv[1]->xref = sv[0];
+  lc::copy(sv, 0, 2, 0);
+  assert(sv.size() == 4 && sv[1]->xref.pinned() == sv[0]);
+  assert(sv[3]->xref.pinned() == sv[2]);
+
+  weak<XrefNode> w = v[2];
+  v.erase(1, 3);
+  assert(!w && v.size() == 5 && v[1]->c == 'd');
+  c.clear();
+  assert(c.empty());
+}
+
+void weak_map_test() {
+  ltm::weak_map<XrefNode, int> m;
+  ltm::own_vector<XrefNode> keys;
+  for (int i = 0; i < 100; i++) {
+    keys.push_back(new XrefNode('a'));
+    m[keys[i]] = i;
+  }
+  assert(m.size() == 100 && *m.find(keys[42]) == 42);
+  own<XrefNode> stranger = new XrefNode('s');
+  assert(!m.find(stranger) && !m.find(nullptr));
+  assert(m.erase(keys[10]) && !m.erase(keys[10]) && m.size() == 99);
+
+  // Dead entries don't break lookups and get purged.
+  keys.erase(0, 50);
+  for (std::size_t i = 0; i < keys.size(); i++)
+    assert(*m.find(keys[i]) == int(i) + 50);
+  m[stranger] = -1;
+  m.sweep();
+  assert(m.size() == 51 && *m.find(stranger) == -1);
+
+  ltm::weak_map<XrefNode, int> c = m;
+  assert(*c.find(keys[7]) == 57);
+  m.clear();
+  assert(!m.find(keys[7]) && c.size() == 51);
+}
+
+void borrow_test() {
+  own<XrefNode> a = new XrefNode('a');
+  weak<XrefNode> w = a;
+  {
+    ltm::borrow<XrefNode> b{w};
+    assert(b && b.get() == a && b->c == 'a');
+    a.check(2 * lc::COUNTER_STEP + lc::OWNED,
+            2 * lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS);
+    pin<XrefNode> p = b.get();
+    a = nullptr;  // the borrow keeps it alive
+    assert(w && p->c == 'a');
+  }
+  assert(!w);
+  ltm::borrow<XrefNode> lost{w};
+  assert(!lost);
+}
+
+struct ValueNode : Object {
+  int value;
+  own<ValueNode> left, right;
+  weak<ValueNode> parent;
+
+  explicit ValueNode(int value) : value(value) {}
+  LTM_COPYABLE(ValueNode);
+};
+
+void port_test() {
+  ltm::port<ValueNode> requests, responses;
+  thread server([&] {
+    while (own<ValueNode> r = requests.receive()) {
+      r->value *= 10;
+      r->left->value *= 10;
+      responses.post(std::move(r));
+    }
+    responses.close();
+  });
+  ValueNode* sent = nullptr;
+  for (int i = 1; i <= 3; i++) {
+    own<ValueNode> r = new ValueNode(i);
+    r->left = new ValueNode(i + 1);
+    r->left->parent = r;
+    sent = &*r;
+    requests.post(std::move(r));
+    assert(!r);
+    r = responses.receive();
+    assert(&*r == sent && r->value == i * 10 && r->left->value == i * 10 + 10);
+    assert(r->left->parent.pinned() == r);
+  }
+  requests.close();
+  server.join();
+  assert(!responses.receive() && !responses.try_receive());
+}
+
+void thread_pool_test() {
+  ltm::thread_pool pool(4);
+  assert(pool.size() == 4);
+  std::atomic<int> sum{0};
+  for (int i = 0; i < 100; i++) {
+    own<ValueNode> n = new ValueNode(i);
+    n->left = new ValueNode(1);
+    pool.run(std::move(n), [&pool, &sum](own<ValueNode>& n) {
+      // Nested tasks go to the queue of this worker.
+      int v = n->value + n->left->value;
+      pool.run([&sum, v] { sum += v; });
+    });
+  }
+  pool.wait();
+  assert(sum == 100 * 99 / 2 + 100);
+}
+
+void epoch_test() {
+  auto make_version = [](int v) {
+    own<ValueNode> r = new ValueNode(v);
+    r->left = new ValueNode(v);
+    r->left->parent = r;
+    return r;
+  };
+  ltm::rcu<ValueNode> current(make_version(0));
+  std::atomic<bool> done{false};
+  std::vector<thread> readers;
+  for (int i = 0; i < 4; i++) {
+    readers.emplace_back([&] {
+      int last = 0;
+      while (!done) {
+        ltm::epoch e;
+        const ValueNode* r = current.get();
+        assert(r->value >= last && r->left->value == r->value);
+        assert(ltm::epoch::get(r->left->parent) == r);
+        last = r->value;
+      }
+    });
+  }
+  for (int v = 1; v <= 1000; v++)
+    current.publish(make_version(v));
+  done = true;
+  for (auto& t : readers)
+    t.join();
+  ltm::epoch::synchronize();
+  {
+    ltm::epoch e;
+    assert(current.get()->value == 1000);
+  }
+}
+
+void compact_test() {
+  own<XrefNode> root = new XrefNode('a', new XrefNode('b'), new XrefNode('c'));
+  weak<XrefNode> outer = root->right;
+  own<XrefNode> stranger = new XrefNode('s');
+  root->left->left = new XrefNode('d');
+  root->left->left->xref = stranger;
+  ltm::compact(root);
+  assert(root->c == 'a' && root->left->c == 'b' && root->right->c == 'c');
+  assert(root->left->xref.pinned() == root);  // inner weaks moved
+  assert(root->right->xref.pinned() == root);
+  assert(outer.pinned() == root->right);  // outer weaks moved
+  assert(root->left->left->xref.pinned() == stranger);
+  root.check(lc::COUNTER_STEP + lc::OWNED,
+             3 * lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS);
+  root->right.check(lc::COUNTER_STEP + lc::OWNED,
+                    2 * lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS);
+
+  own<InlineXrefNode> tree = new InlineXrefNode('a', new InlineXrefNode('b'),
+                                                new InlineXrefNode('c'));
+  weak<InlineXrefNode> w = tree->left;
+  ltm::compact(tree);
+  assert(w.pinned() == tree->left && tree->left->xref.pinned() == tree);
+  tree.check(lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS + lc::INLINE_WEAK,
+             3 * lc::COUNTER_STEP + lc::OWNED + lc::WEAKLESS);
+  // Copies of compacted objects go to the heap.
+  own<InlineXrefNode> copy = tree;
+  tree = nullptr;
+  assert(!w);
+  check_inline_xref_tree(copy);
+}
+
+void arena_test() {
+  weak<XrefNode> w;
+  own<XrefNode> kept;
+  {
+    ltm::arena scope;
+    own<XrefNode> a = new XrefNode('a');
+    own<XrefNode> b = new XrefNode('b');
+    // Bump allocated.
+    assert(reinterpret_cast<char*>(&*b) > reinterpret_cast<char*>(&*a));
+    assert(reinterpret_cast<char*>(&*b) - reinterpret_cast<char*>(&*a) < 256);
+    own<XrefNode> n = new (std::nothrow) XrefNode('n');
+    assert(reinterpret_cast<char*>(&*n) - reinterpret_cast<char*>(&*b) < 256);
+    a = new XrefNode('a', new XrefNode('b'), new XrefNode('c'));
+    w = a->right;
+    own<XrefNode> copy = a;
+    check_xref_tree(copy);
+    {
+      ltm::arena inner;
+      own<XrefNode> temp = copy;
+      temp->left = nullptr;
+    }
+    kept = new XrefNode('k', new XrefNode('l'));
+    scope.keep(kept);
+    assert(w);
+  }
+  assert(!w);
+  assert(kept->c == 'k' && kept->left->xref.pinned() == kept);
+  // Outside of the scope objects go to the heap.
+  kept->right = new XrefNode('r');
+  kept->left = new (std::nothrow) XrefNode('n');
+  kept = nullptr;
+}
+
+#ifdef LTM_STATS
+void stats_test() {
+  ltm::reset_stats();
+  {
+    own<CowNode> a = new CowNode(1);
+    a->left = new CowNode(2);
+    a->parent = a;
+    own<CowNode> b = a;
+    own<SharedInfo> info = new SharedInfo(5);
+    own<SharedInfo> info2 = info;
+  }
+  ltm::Stats s = ltm::get_stats();
+  assert(s.objects_created == 4 && s.objects_disposed == 4);
+  assert(s.weak_blocks_allocated == 3 && s.weak_blocks_freed == 3);
+  assert(s.adopted == 3 && s.shared_retained == 1);
+  assert(s.copied == 1 && s.weaks_copied == 1);
+  assert(s.transactions == 1 && s.transaction_objects == 1);
+  assert(s.peak_transaction_objects == 1);
+
+  thread([] { own<CowNode> n = new CowNode(1); }).join();
+  s = ltm::get_stats();
+  assert(s.objects_created == 5 && s.objects_disposed == 5);
+  ltm::reset_stats();
+  s = ltm::get_stats();
+  assert(s.objects_created == 0 && s.peak_transaction_objects == 0);
+}
+#endif
+
 void main() {
   copy_ops();
   weak_handlers();
+  delegate_test();
+  signal_test();
   construction_and_implicit_conversions();
   auto_construction();
   interaface_test();
   proxy_test();
+  atomic_test();
+  atomic_lock_release_test();
+  weak_block_pool_test();
+  weak_block_pool_remote_free_test();
+  object_with_weak_test();
+  iterative_copy_test();
+  iterative_dispose_test();
+  parallel_copy_test();
+  cow_test();
+  assign_into_test();
+  deep_assign_into_test();
+  own_vector_test();
+  weak_map_test();
+  borrow_test();
+  port_test();
+  thread_pool_test();
+  epoch_test();
+  compact_test();
+  arena_test();
+#ifdef LTM_STATS
+  stats_test();
+#endif
 }
 }  // namespace ltm_tests
 